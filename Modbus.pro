@@ -8,6 +8,12 @@ INCLUDEPATH += include
 HEADERS += \
     include/commons.h \
     include/heap_memory.h \
+    include/mb_coils.h \
+    include/mb_monitor.h \
+    include/mb_profile.h \
+    include/mb_regmap.hpp \
+    include/mb_seqlock.h \
+    include/mb_values.h \
     include/modbus_common.h \
     include/modbus_rtu_client.h
 
@@ -15,4 +21,65 @@ SOURCES += \
     src/commons.c \
     src/heap_memory.c \
     src/main.c \
+    src/mb_coils.c \
+    src/mb_monitor.c \
+    src/mb_profile.c \
+    src/mb_values.c \
     src/modbus_rtu_client.c
+
+unix {
+  HEADERS += include/mb_image.h include/mb_metrics.h include/mb_persist.h include/mb_shm.h include/mb_trace.h
+  SOURCES += src/mb_image.c src/mb_metrics.c src/mb_persist.c src/mb_shm.c src/mb_trace.c
+  linux: LIBS += -lrt
+}
+
+# qmake CONFIG+=profile enables latency histograms (see include/mb_profile.h)
+profile {
+  DEFINES += MB_PROFILE
+}
+
+# qmake CONFIG+=bench builds microbenchmarks instead of test client.
+# output is CSV : group,case,param,samples,iters,min_ns,median_ns,p99_ns
+bench {
+  TARGET = modbus_bench
+  QMAKE_CFLAGS_RELEASE += -O2
+  SOURCES -= src/main.c
+  SOURCES += src/bench.c
+}
+
+# qmake CONFIG+=replay builds bus trace replayer (see include/mb_trace.h)
+replay {
+  TARGET = modbus_replay
+  SOURCES -= src/main.c
+  SOURCES += src/replay.c
+}
+
+# qmake CONFIG+=busim builds pty bus simulator and load generator (linux)
+busim {
+  TARGET = modbus_busim
+  SOURCES -= src/main.c
+  SOURCES += src/busim.c
+}
+
+# qmake CONFIG+=gateway builds modbus tcp to rtu gateway (see src/gateway.c)
+gateway {
+  TARGET = modbus_gateway
+  SOURCES -= src/main.c
+  SOURCES += src/gateway.c
+}
+
+# qmake CONFIG+=wcet builds worst case execution time report (see src/wcet.c)
+wcet {
+  TARGET = modbus_wcet
+  DEFINES += MB_PROFILE
+  QMAKE_CFLAGS_RELEASE += -O2
+  SOURCES -= src/main.c
+  SOURCES += src/wcet.c
+}
+
+# qmake CONFIG+=mkimage builds compiler of map descriptions into images (see include/mb_image.h)
+mkimage {
+  TARGET = modbus_mkimage
+  SOURCES -= src/main.c
+  SOURCES += src/mkimage.c
+}
@@ -6,9 +6,18 @@
 #define UNUSED_ARG(x) ((void)x)
 #define F_CPU 8000000
 
-char* uint16_to_str(char* buff, uint16_t val, uint8_t buff_len);
+//write digits to the end of buff and return pointer to the first one.
+//buff_len includes terminator. if it's shorter than 6, 7 or 11 digits of
+//larger values may not fit, the most significant ones are dropped then.
+char* uint16_to_str(char* buff, uint16_t val, uint16_t buff_len);
 char* int16_to_str(char* buff, int16_t val, uint16_t buff_len);
+char* uint32_to_str(char* buff, uint32_t val, uint16_t buff_len);
 uint16_t crc16(uint8_t* msg, uint16_t len);
+//crc16(msg, len) == crc16_continue(0xffff, msg, len). for split buffers
+uint16_t crc16_continue(uint16_t crc, uint8_t* msg, uint16_t len);
+//crc of two independent buffers, interleaved so cpu can overlap table lookups
+void crc16_x2(uint8_t* msg_a, uint16_t len_a, uint8_t* msg_b, uint16_t len_b,
+              uint16_t* crc_a, uint16_t* crc_b);
 void print_binary(uint8_t val);
 
 #endif  // COMMONS_H
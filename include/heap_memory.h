@@ -5,8 +5,106 @@
 
 typedef uint64_t memory_t;
 
+/*
+ * First-fit heap in one or more arenas. Build time settings :
+ * HM_HEAP_SIZE - size of default arena.
+ * HM_TAG_BITS - block header width, 16, 32 or 64. Arena can't be larger
+ *   than 2^(HM_TAG_BITS-1), blocks are aligned to tag size.
+ * HM_THREAD_SAFE - every arena has own spin lock and hm_malloc of each
+ *   thread uses arena chosen by hm_arena_use. there is no global lock, so
+ *   thread per arena never waits. default on everywhere except avr.
+ * HM_SLAB_SMALL_SIZE/COUNT, HM_SLAB_ADU_SIZE/COUNT - two pools of fixed
+ *   size blocks for diagnostic payloads and mb_adu_t. hm_malloc takes
+ *   blocks up to pool size from them and uses arena only when pool is
+ *   full, so small short living objects don't fragment arena. count 0
+ *   disables pool.
+ */
+
+#ifndef HM_HEAP_SIZE
+#define HM_HEAP_SIZE 2048
+#endif
+
+#ifndef HM_TAG_BITS
+#ifdef __AVR__
+#define HM_TAG_BITS 16
+#else
+#define HM_TAG_BITS 32
+#endif
+#endif
+
+#ifndef HM_THREAD_SAFE
+#ifdef __AVR__
+#define HM_THREAD_SAFE 0
+#else
+#define HM_THREAD_SAFE 1
+#endif
+#endif
+
+#ifndef HM_SLAB_SMALL_SIZE
+#define HM_SLAB_SMALL_SIZE 4
+#endif
+#ifndef HM_SLAB_SMALL_COUNT
+#ifdef __AVR__
+#define HM_SLAB_SMALL_COUNT 8
+#else
+#define HM_SLAB_SMALL_COUNT 64
+#endif
+#endif
+
+#ifndef HM_SLAB_ADU_SIZE
+#ifdef __AVR__
+#define HM_SLAB_ADU_SIZE 8
+#else
+#define HM_SLAB_ADU_SIZE 16
+#endif
+#endif
+#ifndef HM_SLAB_ADU_COUNT
+#ifdef __AVR__
+#define HM_SLAB_ADU_COUNT 8
+#else
+#define HM_SLAB_ADU_COUNT 64
+#endif
+#endif
+
+//arenas hm_free can find blocks in, default one included
+#ifndef HM_MAX_ARENAS
+#define HM_MAX_ARENAS 8
+#endif
+
+typedef struct hm_arena {
+  uint8_t* begin;
+  uint8_t* end;
+  uint32_t alloc_failures;
+  uint8_t lock;
+} hm_arena_t;
+
+typedef struct hm_stat {
+  memory_t size;          //whole arena, tags included
+  memory_t used;          //allocated bytes, tags excluded
+  memory_t free;          //free bytes, tags excluded
+  memory_t largest_free;  //biggest free block
+  uint32_t blocks_used;
+  uint32_t blocks_free;
+  uint32_t alloc_failures; //malloc returned 0 since arena init
+} hm_stat_t;
+
+//(re)initializes default arena and pools
 void hm_init();
+//allocates from pools or arena of calling thread, default one if not set
 memory_t hm_malloc(memory_t size);
+//returns block to arena it was taken from, whichever thread frees it
 void hm_free(memory_t p);
+//stat of default arena. walks all blocks, O(number of blocks)
+void hm_stat(hm_stat_t* st);
+
+//arena in size bytes of mem. returns 0 or -1 if arena is too large or
+//there are HM_MAX_ARENAS already. arena can be initialized again.
+int hm_arena_init(hm_arena_t* a, void* mem, memory_t size);
+//hm_malloc of calling thread takes memory from a, NULL - default arena
+void hm_arena_use(hm_arena_t* a);
+memory_t hm_arena_malloc(hm_arena_t* a, memory_t size);
+void hm_arena_stat(hm_arena_t* a, hm_stat_t* st);
+//blocks taken from pool, idx 0 - small, 1 - adu
+uint16_t hm_slab_used(uint8_t idx);
 
 #endif  // HEAP_MEMORY_H
@@ -0,0 +1,31 @@
+#ifndef MB_COILS_H
+#define MB_COILS_H
+
+#include <stdint.h>
+
+#include "modbus_rtu_client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bit table updates shared by request handlers and application.
+ * Bits of table are MSB first in every byte (address 0 is 0x80 of byte 0).
+ * Multi bit writes build value and mask for every byte and commit them
+ * once per byte, or once per 64 bit word with compare-and-swap if map has
+ * mbbf_atomic. So concurrent writers of neighbour bits never lose them.
+ * Bounds aren't checked.
+ */
+
+//bits are LSB first, as in write multiple coils request
+void mb_coils_write(mb_dev_bit_mapping_t* map, uint16_t address,
+                    const uint8_t* bits, uint16_t quantity);
+void mb_coil_write(mb_dev_bit_mapping_t* map, uint16_t address, uint8_t on);
+uint8_t mb_coil_read(const mb_dev_bit_mapping_t* map, uint16_t address);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // MB_COILS_H
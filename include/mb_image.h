@@ -0,0 +1,101 @@
+#ifndef MB_IMAGE_H
+#define MB_IMAGE_H
+
+#include <stdint.h>
+
+#include "modbus_rtu_client.h"
+
+/*
+ * Device maps compiled into binary image by modbus_mkimage (see
+ * src/mkimage.c for text format). Image is header with slave address
+ * index, device descriptors, read only ranges and tables with initial
+ * values, each table starts at 64 bytes boundary.
+ * mb_image_open maps file privately and checks only descriptors, so
+ * startup doesn't depend on number of registers. Tables are used as
+ * real_addr in place, pages are copied on the first write and file
+ * always keeps initial values (see mb_persist.h to keep changes).
+ * Image is built for host byte order, image of another one is rejected.
+ */
+
+#define MB_IMAGE_MAGIC 0x4d49424du /*"MBIM"*/
+#define MB_IMAGE_VERSION 2
+#define MB_IMAGE_ALIGN 64u
+#define MB_IMAGE_NO_DEVICE 0xff
+
+typedef enum mb_image_table_idx {
+  mbit_input_discrete = 0,
+  mbit_coils,
+  mbit_input_registers,
+  mbit_holding_registers,
+  mbit_count
+} mb_image_table_idx_t;
+
+//start_addr and end_addr are the same as in device mapping.
+//table covers bytes or registers from base_addr to end_addr, base_addr is
+//start_addr rounded down to 64 bit word for mbbf_atomic and start_addr else
+typedef struct mb_image_table {
+  uint32_t offset;        //from the beginning of image, 0 - no table
+  uint32_t size;          //bytes
+  uint16_t start_addr;
+  uint16_t end_addr;
+  uint8_t flags;          //mb_bits_flags_t or mb_registers_flags_t
+  uint8_t reserved;
+  uint16_t base_addr;
+} mb_image_table_t;
+
+//bus can't write [first, last] of coils or holding registers
+typedef struct mb_image_range {
+  uint16_t first;         //bit or register
+  uint16_t last;
+  uint8_t table;          //mb_image_table_idx_t
+  uint8_t reserved[3];
+} mb_image_range_t;
+
+typedef struct mb_image_device {
+  uint8_t address;
+  uint8_t reserved[3];
+  uint32_t ro_offset;     //mb_image_range_t array sorted by table and first
+  uint32_t ro_count;
+  uint32_t reserved2;
+  mb_image_table_t tables[mbit_count];
+} mb_image_device_t;
+
+typedef struct mb_image_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;   //sizeof(mb_image_header_t), devices follow header
+  uint32_t total_size;
+  uint16_t devices_count;
+  uint16_t reserved;
+  uint8_t device_idx[256];//slave address -> device, MB_IMAGE_NO_DEVICE
+} mb_image_header_t;
+
+typedef struct mb_image {
+  mb_image_header_t* hdr;
+  uint64_t map_len;
+} mb_image_t;
+
+//maps image and checks layout. returns 0 on success
+int mb_image_open(mb_image_t* img, const char* path);
+void mb_image_close(mb_image_t* img);
+
+static inline const mb_image_device_t*
+mb_image_device(const mb_image_t* img, uint8_t address) {
+  uint8_t i = img->hdr->device_idx[address];
+  if (i == MB_IMAGE_NO_DEVICE) return NULL;
+  return (const mb_image_device_t*)((const uint8_t*)img->hdr + img->hdr->header_size) + i;
+}
+
+//sets address, all four maps of dev and ctx to img, other fields are left
+//as they are, img should stay open while dev is used.
+//returns -1 if image has no such device
+int mb_image_attach(mb_image_t* img, uint8_t address, mb_client_device_t* dev);
+
+//mbec_illegal_data_address if bus write request touches read only range
+//of device. req as passed to pf_check_write.
+uint16_t mb_image_check_write(const mb_image_t* img, uint8_t address,
+                              const mb_request_t* req);
+//ready pf_check_write, checks against image set by mb_image_attach
+uint16_t mb_image_check_bus_write(mb_client_device_t* dev, const mb_request_t* req);
+
+#endif  // MB_IMAGE_H
@@ -0,0 +1,40 @@
+#ifndef MB_METRICS_H
+#define MB_METRICS_H
+
+#include <stdint.h>
+
+#include "modbus_rtu_client.h"
+
+/*
+ * Counters, heap stats and selected registers as Prometheus text
+ * exposition. Text is built with uint32_to_str and memcpy, no printf,
+ * so rendering once per second costs next to nothing. Render from the
+ * same context as mb_handle_request, then hand the text to file or
+ * local socket output which don't touch device state.
+ */
+
+//register exported as modbus_register{slave="address",name="name",addr="reg"}
+//name goes into label as is, so it shouldn't contain quotes or backslashes
+typedef struct mb_metrics_register {
+  const char* name;
+  uint8_t address;
+  const mb_dev_registers_mapping_t* map;
+  uint16_t reg;
+} mb_metrics_register_t;
+
+//returns text length or 0 if buff_len isn't enough.
+//about 1.2KB plus 300 bytes per device plus 60 bytes per register is enough
+uint32_t mb_metrics_render(char* buff, uint32_t buff_len,
+                           const mb_metrics_register_t* regs, uint16_t regs_count);
+
+//writes path.tmp and renames it to path, readers never see partial file
+//(node exporter textfile collector). returns 0 on success
+int mb_metrics_write_file(const char* path, const char* text, uint32_t len);
+
+//unix stream socket, every accepted connection gets text and is closed.
+//returns listening fd or -1
+int mb_metrics_listen(const char* path);
+//accepts pending connections without blocking, returns how many were served
+int mb_metrics_serve(int fd, const char* text, uint32_t len);
+
+#endif  // MB_METRICS_H
@@ -0,0 +1,44 @@
+#ifndef MB_MONITOR_H
+#define MB_MONITOR_H
+
+#include <stdint.h>
+
+/*
+ * Passive bus monitor. Every frame seen on the bus is passed to
+ * mb_monitor_frame, monitor pairs requests with responses and keeps
+ * statistics per slave address and per function code in static tables.
+ * Nothing is allocated per frame, nothing is sent to the bus.
+ */
+
+#define MB_MONITOR_FC_COUNT 0x80 //exception bit stripped
+
+typedef struct mb_monitor_stat {
+  uint32_t requests;
+  uint32_t responses;
+  uint32_t exceptions;   //responses with exception bit
+  uint32_t timeouts;     //request without response
+  uint32_t latency_min;  //ns, request end -> response end
+  uint32_t latency_max;  //ns
+  uint64_t latency_sum;  //ns, divide by responses for average
+} mb_monitor_stat_t;
+
+typedef struct mb_monitor_bus_stat {
+  uint32_t frames;
+  uint32_t crc_errors;   //also frames shorter than 4 bytes
+  uint32_t broadcasts;
+  uint32_t unexpected;   //response-like frames which don't match request
+  uint32_t late;         //responses to requests which already timed out
+} mb_monitor_bus_stat_t;
+
+//timeout_ns is max time between request and response.
+void mb_monitor_init(uint32_t timeout_ns);
+//ts_ns is time when the last byte of frame was received
+void mb_monitor_frame(const uint8_t* data, uint16_t len, uint64_t ts_ns);
+//expires pending request if there is no traffic on the bus
+void mb_monitor_tick(uint64_t now_ns);
+
+const mb_monitor_stat_t* mb_monitor_slave_stat(uint8_t address);
+const mb_monitor_stat_t* mb_monitor_fc_stat(uint8_t fc);
+const mb_monitor_bus_stat_t* mb_monitor_bus_stat();
+
+#endif  // MB_MONITOR_H
@@ -0,0 +1,50 @@
+#ifndef MB_PERSIST_H
+#define MB_PERSIST_H
+
+#include <stdint.h>
+
+#include "modbus_rtu_client.h"
+
+/*
+ * Holding registers and coils kept in memory mapped file.
+ * File has header, working tables and two snapshots. Device works with
+ * working tables directly, sync copies them into the older snapshot,
+ * flushes it and only then switches header to it. So after power loss
+ * file always has complete image of some sync, never a torn one.
+ * Open of existing file with the same layout restores last snapshot,
+ * no config parsing is needed.
+ */
+
+typedef struct mb_persist {
+  uint8_t* map;
+  uint64_t map_len;
+  uint64_t region_len;    //page aligned size of tables
+  uint16_t* holding;      //working tables, use them as real_addr
+  uint8_t* coils;
+  uint16_t holding_count;
+  uint16_t coils_bytes;
+  int fd;
+  //sync policy, see mb_persist_poll
+  uint16_t sync_writes;   //sync after so many write requests
+  uint16_t sync_delay_ms; //or when the oldest unsynced write is so old
+  uint16_t dirty;         //write requests since last sync
+  uint16_t dirty_age_ms;
+} mb_persist_t;
+
+//returns 0 on success. restored is 1 if tables were loaded from file
+int mb_persist_open(mb_persist_t* p, const char* path,
+                    uint16_t holding_count, uint16_t coils_bytes,
+                    uint8_t* restored);
+//points holding registers and coils maps of dev to working tables.
+//tables start from address 0, returns -1 if end_addr of dev map is past
+//holding_count or coils_bytes
+int mb_persist_attach(mb_persist_t* p, mb_client_device_t* dev);
+//call from pf_after_write
+void mb_persist_note_write(mb_persist_t* p);
+//call periodically. syncs when policy says so
+void mb_persist_poll(mb_persist_t* p, uint16_t elapsed_ms);
+int mb_persist_sync(mb_persist_t* p);
+//syncs and unmaps
+void mb_persist_close(mb_persist_t* p);
+
+#endif  // MB_PERSIST_H
@@ -0,0 +1,72 @@
+#ifndef MB_PROFILE_H
+#define MB_PROFILE_H
+
+#include <stdint.h>
+
+/*
+ * Optional latency instrumentation of mb_handle_request, enabled with
+ * MB_PROFILE define. Every stage of every function code has histogram
+ * with log2 buckets of cycles : bucket i counts values in [2^(i-1), 2^i).
+ * Without MB_PROFILE all PROF_* macros are empty.
+ */
+
+typedef enum mb_profile_stage {
+  mbps_crc = 0,   //crc check of request
+  mbps_validate,  //parse adu, function code, address and data checks
+  mbps_execute,   //pf_execute_function
+  mbps_serialize, //adu_serialize
+  mbps_send,      //tp_send
+  mbps_total,     //whole mb_handle_request
+  mbps_count
+} mb_profile_stage_t;
+
+#define MB_PROFILE_BUCKETS 32
+#define MB_PROFILE_MAX_FC 0x2c  //function codes above go to slot 0
+
+typedef struct mb_histogram {
+  uint32_t count;
+  uint32_t max;    //cycles, saturated
+  uint64_t sum;
+  uint32_t buckets[MB_PROFILE_BUCKETS];
+} mb_histogram_t;
+
+#ifdef MB_PROFILE
+
+static inline uint64_t
+mb_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+  uint64_t v;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+  return v;
+#else
+  extern uint64_t mb_cycles_port(); //should be provided by target
+  return mb_cycles_port();
+#endif
+}
+
+void mb_profile_record(uint8_t fc, mb_profile_stage_t stage, uint64_t cycles);
+//returns NULL for wrong stage
+const mb_histogram_t* mb_profile_histogram(uint8_t fc, mb_profile_stage_t stage);
+void mb_profile_reset();
+
+#define PROF_DECL(t) uint64_t t = mb_cycles()
+#define PROF_MARK(t) ((t) = mb_cycles())
+#define PROF_STAGE(fc, stage, t) do { \
+    uint64_t prof_now_ = mb_cycles(); \
+    mb_profile_record((fc), (stage), prof_now_ - (t)); \
+    (t) = prof_now_; \
+  } while (0)
+#define PROF_SINCE(fc, stage, t) mb_profile_record((fc), (stage), mb_cycles() - (t))
+
+#else
+
+#define PROF_DECL(t)
+#define PROF_MARK(t)
+#define PROF_STAGE(fc, stage, t)
+#define PROF_SINCE(fc, stage, t)
+
+#endif
+
+#endif  // MB_PROFILE_H
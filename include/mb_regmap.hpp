@@ -0,0 +1,318 @@
+#ifndef MB_REGMAP_HPP
+#define MB_REGMAP_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <type_traits>
+
+#include "modbus_rtu_client.h"
+#include "mb_values.h"
+
+/*
+ * Optional header only C++14 layer. Register map is declared as list of
+ * field types, every field has table, address, value type and bus access:
+ *
+ *   using voltage = mb::holding<100, float, mb::access::read_only>;
+ *   using relay   = mb::coil<3>;
+ *   mb::register_map<voltage, relay> map;
+ *   map.attach(dev);
+ *   map.set<voltage>(229.5f);
+ *
+ * Storage of every table covers exactly [first field, last field end),
+ * start_addr/end_addr of device maps are computed from it, so bounds check
+ * of requests is one compare against constants built at compile time.
+ * Overlapping fields, addresses past 0xfffe and value types which don't
+ * fit table are compile errors. Typed accessors resolve storage offset and
+ * value order at compile time, there is no runtime check or lookup.
+ * Accessors don't take seqlocks, use them from the same context as
+ * mb_handle_request.
+ */
+
+namespace mb {
+
+//same values as mb_table_t
+enum class table : uint8_t {
+  discrete_inputs = mbt_discrete_inputs,
+  coils = mbt_coils,
+  input_registers = mbt_input_registers,
+  holding_registers = mbt_holding_registers
+};
+
+//bus access. application can always set any field
+enum class access : uint8_t {
+  read_only,
+  read_write
+};
+
+template <typename T> struct value_traits { static constexpr uint8_t width = 0; };
+template <> struct value_traits<bool> { static constexpr uint8_t width = 1; typedef uint8_t raw; };
+template <> struct value_traits<uint16_t> { static constexpr uint8_t width = 1; typedef uint16_t raw; };
+template <> struct value_traits<int16_t> { static constexpr uint8_t width = 1; typedef uint16_t raw; };
+template <> struct value_traits<uint32_t> { static constexpr uint8_t width = 2; typedef uint32_t raw; };
+template <> struct value_traits<int32_t> { static constexpr uint8_t width = 2; typedef uint32_t raw; };
+template <> struct value_traits<float> { static constexpr uint8_t width = 2; typedef uint32_t raw; };
+template <> struct value_traits<uint64_t> { static constexpr uint8_t width = 4; typedef uint64_t raw; };
+template <> struct value_traits<int64_t> { static constexpr uint8_t width = 4; typedef uint64_t raw; };
+template <> struct value_traits<double> { static constexpr uint8_t width = 4; typedef uint64_t raw; };
+
+constexpr bool is_bit_table(table t) {
+  return t == table::discrete_inputs || t == table::coils;
+}
+
+template <table Tbl, uint16_t Addr, typename T,
+          access Acc = access::read_write, uint8_t Order = mbvo_abcd>
+struct field {
+  typedef T type;
+  static constexpr table tbl = Tbl;
+  static constexpr uint16_t addr = Addr;
+  static constexpr uint8_t width = value_traits<T>::width; //bits or registers
+  static constexpr access acc =
+      (Tbl == table::coils || Tbl == table::holding_registers) ? Acc : access::read_only;
+  static constexpr uint8_t order = Order;
+
+  static_assert(width != 0, "register map: unsupported value type");
+  static_assert(is_bit_table(Tbl) == std::is_same<T, bool>::value,
+                "register map: bit tables hold bool, register tables hold numbers");
+  static_assert((uint32_t)Addr + width <= 0xffff, "register map: field is out of range");
+};
+
+template <uint16_t Addr, access Acc = access::read_write>
+using coil = field<table::coils, Addr, bool, Acc>;
+template <uint16_t Addr>
+using discrete_input = field<table::discrete_inputs, Addr, bool>;
+template <uint16_t Addr, typename T, access Acc = access::read_write, uint8_t Order = mbvo_abcd>
+using holding = field<table::holding_registers, Addr, T, Acc, Order>;
+template <uint16_t Addr, typename T, uint8_t Order = mbvo_abcd>
+using input = field<table::input_registers, Addr, T, access::read_only, Order>;
+
+template <typename F, typename... Fs> struct contains;
+template <typename F> struct contains<F> { static constexpr bool value = false; };
+template <typename F, typename H, typename... Fs> struct contains<F, H, Fs...> {
+  static constexpr bool value = contains<F, Fs...>::value;
+};
+template <typename F, typename... Fs> struct contains<F, F, Fs...> {
+  static constexpr bool value = true;
+};
+
+template <typename... Fields>
+class register_map {
+ public:
+  struct desc {
+    table tbl;
+    uint16_t addr;
+    uint8_t width;
+    access acc;
+  };
+  struct span {
+    uint32_t lo;  //first bit or register
+    uint32_t hi;  //one past the last, 0 if table is empty
+  };
+
+ private:
+  //trailing zero desc keeps array non empty
+  static constexpr desc m_desc[] = {{Fields::tbl, Fields::addr, Fields::width, Fields::acc}...,
+                                    {table::discrete_inputs, 0, 0, access::read_only}};
+  static constexpr size_t m_count = sizeof...(Fields);
+
+  static constexpr span table_span(table t) {
+    span s = {0xffffffffu, 0};
+    for (size_t i = 0; i < m_count; ++i) {
+      if (m_desc[i].tbl != t) continue;
+      if (m_desc[i].addr < s.lo) s.lo = m_desc[i].addr;
+      if ((uint32_t)m_desc[i].addr + m_desc[i].width > s.hi)
+        s.hi = (uint32_t)m_desc[i].addr + m_desc[i].width;
+    }
+    if (!s.hi) s.lo = 0;
+    return s;
+  }
+
+  static constexpr bool no_overlap() {
+    for (size_t i = 0; i < m_count; ++i)
+      for (size_t j = i + 1; j < m_count; ++j)
+        if (m_desc[i].tbl == m_desc[j].tbl &&
+            m_desc[i].addr < m_desc[j].addr + m_desc[j].width &&
+            m_desc[j].addr < m_desc[i].addr + m_desc[i].width)
+          return false;
+    return true;
+  }
+
+  static constexpr bool has_read_only(table t) {
+    for (size_t i = 0; i < m_count; ++i)
+      if (m_desc[i].tbl == t && m_desc[i].acc == access::read_only)
+        return true;
+    return false;
+  }
+
+  static_assert(no_overlap(), "register map: fields overlap");
+
+  //bit tables are addressed by bytes in mb_dev_bit_mapping_t
+  static constexpr span di_ = {table_span(table::discrete_inputs).lo / 8,
+                               (table_span(table::discrete_inputs).hi + 7) / 8};
+  static constexpr span co_ = {table_span(table::coils).lo / 8,
+                               (table_span(table::coils).hi + 7) / 8};
+  static constexpr span ir_ = table_span(table::input_registers);
+  static constexpr span hr_ = table_span(table::holding_registers);
+
+  static constexpr size_t len(span s) { return s.hi - s.lo ? s.hi - s.lo : 1; }
+
+  uint8_t m_discrete[len(di_)];
+  uint8_t m_coils[len(co_)];
+  uint16_t m_input[len(ir_)];
+  uint16_t m_holding[len(hr_)];
+
+  template <table Tbl> struct tag {};
+  uint16_t* regs(tag<table::input_registers>) { return m_input - ir_.lo; }
+  uint16_t* regs(tag<table::holding_registers>) { return m_holding - hr_.lo; }
+  const uint16_t* regs(tag<table::input_registers>) const { return m_input - ir_.lo; }
+  const uint16_t* regs(tag<table::holding_registers>) const { return m_holding - hr_.lo; }
+  uint8_t* bits(tag<table::discrete_inputs>) { return m_discrete - di_.lo; }
+  uint8_t* bits(tag<table::coils>) { return m_coils - co_.lo; }
+  const uint8_t* bits(tag<table::discrete_inputs>) const { return m_discrete - di_.lo; }
+  const uint8_t* bits(tag<table::coils>) const { return m_coils - co_.lo; }
+
+  static uint16_t swap16(uint16_t x) { return (uint16_t)((x << 8) | (x >> 8)); }
+
+  //same layout as mb_get_u32s and friends, resolved at compile time
+  template <uint8_t W, uint8_t Order>
+  static uint64_t load(const uint16_t* r) {
+    uint64_t v = 0;
+    for (uint8_t i = 0; i < W; ++i) {
+      uint16_t x = r[(Order & mbvo_word_swap) ? W - 1 - i : i];
+      v = (v << 16) | ((Order & mbvo_byte_swap) ? swap16(x) : x);
+    }
+    return v;
+  }
+
+  template <uint8_t W, uint8_t Order>
+  static void store(uint16_t* r, uint64_t v) {
+    for (uint8_t i = 0; i < W; ++i) {
+      uint16_t x = (uint16_t)(v >> (16 * (W - 1 - i)));
+      r[(Order & mbvo_word_swap) ? W - 1 - i : i] = (Order & mbvo_byte_swap) ? swap16(x) : x;
+    }
+  }
+
+  template <typename F>
+  static void check_field() {
+    static_assert(contains<F, Fields...>::value, "register map: field isn't in this map");
+  }
+
+  //write of [addr, addr + qty) in table t touches read only field
+  static bool write_denied(table t, uint16_t addr, uint16_t qty) {
+    for (size_t i = 0; i < m_count; ++i)
+      if (m_desc[i].tbl == t && m_desc[i].acc == access::read_only &&
+          addr < m_desc[i].addr + m_desc[i].width &&
+          m_desc[i].addr < (uint32_t)addr + qty)
+        return true;
+    return false;
+  }
+
+ public:
+  register_map() {
+    memset(m_discrete, 0, sizeof(m_discrete));
+    memset(m_coils, 0, sizeof(m_coils));
+    memset(m_input, 0, sizeof(m_input));
+    memset(m_holding, 0, sizeof(m_holding));
+  }
+
+  //first bit or register and one past the last one of table
+  static constexpr span bounds(table t) { return table_span(t); }
+
+  //points all four maps of dev to storage of this map
+  void attach(mb_client_device_t& dev) {
+    dev.input_discrete_map.start_addr = (uint16_t)di_.lo;
+    dev.input_discrete_map.end_addr = (uint16_t)di_.hi;
+    dev.input_discrete_map.real_addr = bits(tag<table::discrete_inputs>());
+    dev.input_discrete_map.flags = mbbf_plain;
+    dev.input_discrete_map.seqlock = NULL;
+    dev.coils_map.start_addr = (uint16_t)co_.lo;
+    dev.coils_map.end_addr = (uint16_t)co_.hi;
+    dev.coils_map.real_addr = bits(tag<table::coils>());
+    dev.coils_map.flags = mbbf_plain;
+    dev.coils_map.seqlock = NULL;
+    dev.input_registers_map.start_addr = (uint16_t)ir_.lo;
+    dev.input_registers_map.end_addr = (uint16_t)ir_.hi;
+    dev.input_registers_map.real_addr = regs(tag<table::input_registers>());
+    dev.input_registers_map.flags = mbrf_host_order;
+    dev.input_registers_map.seqlock = NULL;
+    dev.holding_registers_map.start_addr = (uint16_t)hr_.lo;
+    dev.holding_registers_map.end_addr = (uint16_t)hr_.hi;
+    dev.holding_registers_map.real_addr = regs(tag<table::holding_registers>());
+    dev.holding_registers_map.flags = mbrf_host_order;
+    dev.holding_registers_map.seqlock = NULL;
+  }
+
+  template <typename F>
+  typename F::type get() const {
+    check_field<F>();
+    return get(F(), std::integral_constant<bool, is_bit_table(F::tbl)>());
+  }
+
+  template <typename F>
+  void set(typename F::type v) {
+    check_field<F>();
+    set(F(), v, std::integral_constant<bool, is_bit_table(F::tbl)>());
+  }
+
+  //mbec_illegal_data_address if bus write request touches read only field.
+  //request is already decoded and range checked.
+  static uint16_t check_bus_write(const mb_request_t* req) {
+    if (!req->wr_quantity ||
+        (!has_read_only(table::coils) && !has_read_only(table::holding_registers)))
+      return mbec_OK;
+    return write_denied(static_cast<table>(req->table), req->wr_address, req->wr_quantity) ?
+        mbec_illegal_data_address : mbec_OK;
+  }
+
+  //ready pf_check_write if application doesn't need its own
+  static uint16_t check_write(mb_client_device_t* dev, const mb_request_t* req) {
+    (void)dev;
+    return check_bus_write(req);
+  }
+
+ private:
+  template <typename F>
+  bool get(F, std::true_type) const {
+    return bits(tag<F::tbl>())[F::addr / 8] & (0x80 >> F::addr % 8);
+  }
+
+  template <typename F>
+  void set(F, bool v, std::true_type) {
+    uint8_t* b = &bits(tag<F::tbl>())[F::addr / 8];
+    if (v) *b |= (uint8_t)(0x80 >> F::addr % 8);
+    else *b &= (uint8_t)~(0x80 >> F::addr % 8);
+  }
+
+  template <typename F>
+  typename F::type get(F, std::false_type) const {
+    typedef typename value_traits<typename F::type>::raw raw_t;
+    raw_t raw = (raw_t)load<F::width, F::order>(&regs(tag<F::tbl>())[F::addr]);
+    typename F::type v;
+    memcpy(&v, &raw, sizeof(v));
+    return v;
+  }
+
+  template <typename F>
+  void set(F, typename F::type v, std::false_type) {
+    typedef typename value_traits<typename F::type>::raw raw_t;
+    raw_t raw;
+    memcpy(&raw, &v, sizeof(raw));
+    store<F::width, F::order>(&regs(tag<F::tbl>())[F::addr], raw);
+  }
+};
+
+template <typename... Fields>
+constexpr typename register_map<Fields...>::desc register_map<Fields...>::m_desc[];
+template <typename... Fields>
+constexpr typename register_map<Fields...>::span register_map<Fields...>::di_;
+template <typename... Fields>
+constexpr typename register_map<Fields...>::span register_map<Fields...>::co_;
+template <typename... Fields>
+constexpr typename register_map<Fields...>::span register_map<Fields...>::ir_;
+template <typename... Fields>
+constexpr typename register_map<Fields...>::span register_map<Fields...>::hr_;
+
+}  // namespace mb
+
+#endif  // MB_REGMAP_HPP
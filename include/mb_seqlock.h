@@ -0,0 +1,75 @@
+#ifndef MB_SEQLOCK_H
+#define MB_SEQLOCK_H
+
+#include <stdint.h>
+
+/*
+ * Sequence lock for tables shared with other processes/threads.
+ * Odd value - table is being changed. Writers take it with CAS, so
+ * several writers exclude each other; readers never block writers, they
+ * copy data and retry if sequence changed meanwhile.
+ * Single core targets without other processes don't need it.
+ * Writer which dies inside keeps sequence odd forever, so waits are
+ * bounded : lock and read begin give up after MB_SEQ_SPINS attempts.
+ */
+
+#ifndef MB_SEQ_SPINS
+#define MB_SEQ_SPINS 100000u
+#endif
+
+#ifdef __AVR__
+
+static inline uint8_t mb_seq_write_lock(uint32_t* seq) { (void)seq; return 1; }
+static inline void mb_seq_write_unlock(uint32_t* seq) { (void)seq; }
+static inline uint8_t mb_seq_read_begin(const uint32_t* seq, uint32_t* start) {
+  (void)seq; *start = 0; return 1;
+}
+static inline uint8_t mb_seq_read_retry(const uint32_t* seq, uint32_t start) {
+  (void)seq; (void)start; return 0;
+}
+
+#else
+
+//1 - locked, 0 - another writer holds it too long
+static inline uint8_t
+mb_seq_write_lock(uint32_t* seq) {
+  uint32_t s, spins;
+  for (spins = 0; spins < MB_SEQ_SPINS; ++spins) {
+    s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    if (!(s & 1) &&
+        __atomic_compare_exchange_n(seq, &s, s + 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      //data stores below must not become visible before odd sequence
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static inline void
+mb_seq_write_unlock(uint32_t* seq) {
+  __atomic_store_n(seq, __atomic_load_n(seq, __ATOMIC_RELAXED) + 1,
+                   __ATOMIC_RELEASE);
+}
+
+//1 - start is set, copy data. 0 - writer holds it too long
+static inline uint8_t
+mb_seq_read_begin(const uint32_t* seq, uint32_t* start) {
+  uint32_t spins;
+  for (spins = 0; spins < MB_SEQ_SPINS; ++spins)
+    if (!((*start = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1))
+      return 1;
+  return 0;
+}
+
+//call after data is copied. 1 - copy is torn, read again
+static inline uint8_t
+mb_seq_read_retry(const uint32_t* seq, uint32_t start) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+#endif
+
+#endif  // MB_SEQLOCK_H
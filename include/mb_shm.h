@@ -0,0 +1,79 @@
+#ifndef MB_SHM_H
+#define MB_SHM_H
+
+#include <stdint.h>
+
+#include "modbus_rtu_client.h"
+
+/*
+ * Device tables in POSIX shared memory segment, so local processes can
+ * read and write registers without copying them over sockets.
+ * Segment is a header (layout and one seqlock per table) followed by
+ * tables, each one starts at 64 bytes boundary. Server creates segment
+ * and attaches it to device, other processes open it by name and use
+ * mb_shm_read/mb_shm_write or seqlock functions directly.
+ */
+
+#define MB_SHM_MAGIC 0x4d48534du /*"MSHM"*/
+#define MB_SHM_VERSION 1
+
+typedef enum mb_shm_table_idx {
+  mbst_input_discrete = 0,
+  mbst_coils,
+  mbst_input_registers,
+  mbst_holding_registers,
+  mbst_count
+} mb_shm_table_idx_t;
+
+//seqlock first and alone in cache line, writers bounce only it
+typedef struct mb_shm_table {
+  uint32_t seq;
+  uint32_t offset;        //from the beginning of segment
+  uint32_t size;          //bytes
+  uint16_t start_addr;    //same as in device mapping
+  uint16_t end_addr;
+  uint8_t flags;          //mb_bits_flags_t or mb_registers_flags_t
+  uint8_t reserved[47];
+} mb_shm_table_t;
+
+typedef struct mb_shm_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;   //sizeof(mb_shm_header_t)
+  uint32_t total_size;
+  uint8_t reserved[52];
+  mb_shm_table_t tables[mbst_count];
+} mb_shm_header_t;
+
+typedef struct mb_shm {
+  mb_shm_header_t* hdr;
+  uint32_t map_len;
+  int fd;
+} mb_shm_t;
+
+//creates (or recreates) segment with tables sized by maps of layout.
+//bit tables are end_addr bytes, register tables end_addr registers.
+int mb_shm_create(mb_shm_t* shm, const char* name, const mb_client_device_t* layout);
+//maps existing segment. fails if layout version differs or any table
+//doesn't fit segment.
+int mb_shm_open(mb_shm_t* shm, const char* name);
+void mb_shm_close(mb_shm_t* shm);
+int mb_shm_unlink(const char* name);
+
+//sets all four maps of dev from segment header : bounds, flags,
+//real_addr and seqlock.
+void mb_shm_attach(mb_shm_t* shm, mb_client_device_t* dev);
+
+static inline uint8_t*
+mb_shm_table(const mb_shm_t* shm, mb_shm_table_idx_t idx) {
+  return (uint8_t*)shm->hdr + shm->hdr->tables[idx].offset;
+}
+
+//consistent copy of len bytes from offset of table. returns 0 on success,
+//-1 if range is out of table or writer holds table too long
+int mb_shm_read(mb_shm_t* shm, mb_shm_table_idx_t idx, uint32_t offset,
+                void* dst, uint32_t len);
+int mb_shm_write(mb_shm_t* shm, mb_shm_table_idx_t idx, uint32_t offset,
+                 const void* src, uint32_t len);
+
+#endif  // MB_SHM_H
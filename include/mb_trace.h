@@ -0,0 +1,66 @@
+#ifndef MB_TRACE_H
+#define MB_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Binary bus trace. File is a header followed by a ring of records,
+ * whole file is memory mapped, so recording is a couple of memcpy calls
+ * and trace survives crash of the process.
+ * Record is 16 bytes header + raw frame (with crc), padded to 16 bytes.
+ * When ring is full the oldest records are dropped.
+ */
+
+#define MB_TRACE_MAGIC 0x5254424du /*"MBTR"*/
+#define MB_TRACE_VERSION 1
+
+typedef enum mb_trace_dir {
+  mbtd_rx = 0,      //frame received by device (request)
+  mbtd_tx = 1,      //frame sent by device (response)
+  mbtd_wrap = 0xff  //filler up to the end of ring, not a frame
+} mb_trace_dir_t;
+
+//both structures are naturally aligned, no packing needed
+typedef struct mb_trace_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint64_t capacity;  //ring size in bytes, multiple of 16
+  uint64_t head;      //monotonic write offset
+  uint64_t tail;      //monotonic offset of the oldest record
+} mb_trace_header_t;
+
+typedef struct mb_trace_record {
+  uint64_t ts_ns;     //CLOCK_MONOTONIC
+  uint16_t len;       //frame length
+  uint8_t dir;        //mb_trace_dir_t
+  uint8_t reserved[5];
+} mb_trace_record_t;
+
+typedef struct mb_trace {
+  mb_trace_header_t* hdr;
+  uint8_t* ring;
+  uint64_t map_len;
+  int fd;
+} mb_trace_t;
+
+//creates (or truncates) trace file with ring of capacity bytes.
+int mb_trace_create(mb_trace_t* trace, const char* path, uint64_t capacity);
+//maps existing trace read only.
+int mb_trace_open(mb_trace_t* trace, const char* path);
+void mb_trace_close(mb_trace_t* trace);
+
+//call from receive path and from tp_send.
+void mb_trace_write(mb_trace_t* trace, mb_trace_dir_t dir,
+                    const uint8_t* data, uint16_t len);
+void mb_trace_write_ts(mb_trace_t* trace, uint64_t ts_ns, mb_trace_dir_t dir,
+                       const uint8_t* data, uint16_t len);
+
+//cursor should be initialized with mb_trace_begin. returns 0 at the end.
+uint64_t mb_trace_begin(const mb_trace_t* trace);
+int mb_trace_next(const mb_trace_t* trace, uint64_t* cursor,
+                  const mb_trace_record_t** rec, const uint8_t** data);
+
+uint64_t mb_trace_now_ns();
+
+#endif  // MB_TRACE_H
@@ -0,0 +1,125 @@
+#ifndef MB_VALUES_H
+#define MB_VALUES_H
+
+#include <stdint.h>
+
+#include "modbus_rtu_client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * 32 and 64 bit values kept in 2 or 4 consecutive registers.
+ * Order describes how value is laid out in registers, it doesn't depend on
+ * storage order of the map (mbrf_host_order or mbrf_wire_order).
+ * addr is index in real_addr, as for mb_register_get. Bounds aren't checked.
+ * Bulk functions handle count values at once, order is resolved once per
+ * call, so loops are branch free and can be vectorized.
+ */
+
+typedef enum mb_value_order {
+  mbvo_word_swap = 0x01,  //least significant register first
+  mbvo_byte_swap = 0x02,  //LSB first inside every register
+  mbvo_abcd = 0x00,       //modbus default, big endian
+  mbvo_cdab = mbvo_word_swap,
+  mbvo_badc = mbvo_byte_swap,
+  mbvo_dcba = mbvo_word_swap | mbvo_byte_swap  //little endian
+} mb_value_order_t;
+
+void mb_get_u32s(const mb_dev_registers_mapping_t* map, uint16_t addr,
+                 uint32_t* dst, uint16_t count, uint8_t order);
+void mb_set_u32s(mb_dev_registers_mapping_t* map, uint16_t addr,
+                 const uint32_t* src, uint16_t count, uint8_t order);
+void mb_get_f32s(const mb_dev_registers_mapping_t* map, uint16_t addr,
+                 float* dst, uint16_t count, uint8_t order);
+void mb_set_f32s(mb_dev_registers_mapping_t* map, uint16_t addr,
+                 const float* src, uint16_t count, uint8_t order);
+
+void mb_get_u64s(const mb_dev_registers_mapping_t* map, uint16_t addr,
+                 uint64_t* dst, uint16_t count, uint8_t order);
+void mb_set_u64s(mb_dev_registers_mapping_t* map, uint16_t addr,
+                 const uint64_t* src, uint16_t count, uint8_t order);
+#if __SIZEOF_DOUBLE__ == 8 //avr double is float
+void mb_get_f64s(const mb_dev_registers_mapping_t* map, uint16_t addr,
+                 double* dst, uint16_t count, uint8_t order);
+void mb_set_f64s(mb_dev_registers_mapping_t* map, uint16_t addr,
+                 const double* src, uint16_t count, uint8_t order);
+#endif
+
+/*single values*/
+static inline uint32_t
+mb_get_u32(const mb_dev_registers_mapping_t* map, uint16_t addr, uint8_t order) {
+  uint32_t v;
+  mb_get_u32s(map, addr, &v, 1, order);
+  return v;
+}
+
+static inline int32_t
+mb_get_i32(const mb_dev_registers_mapping_t* map, uint16_t addr, uint8_t order) {
+  return (int32_t)mb_get_u32(map, addr, order);
+}
+
+static inline float
+mb_get_f32(const mb_dev_registers_mapping_t* map, uint16_t addr, uint8_t order) {
+  float v;
+  mb_get_f32s(map, addr, &v, 1, order);
+  return v;
+}
+
+static inline uint64_t
+mb_get_u64(const mb_dev_registers_mapping_t* map, uint16_t addr, uint8_t order) {
+  uint64_t v;
+  mb_get_u64s(map, addr, &v, 1, order);
+  return v;
+}
+
+static inline int64_t
+mb_get_i64(const mb_dev_registers_mapping_t* map, uint16_t addr, uint8_t order) {
+  return (int64_t)mb_get_u64(map, addr, order);
+}
+
+static inline void
+mb_set_u32(mb_dev_registers_mapping_t* map, uint16_t addr, uint32_t v, uint8_t order) {
+  mb_set_u32s(map, addr, &v, 1, order);
+}
+
+static inline void
+mb_set_i32(mb_dev_registers_mapping_t* map, uint16_t addr, int32_t v, uint8_t order) {
+  mb_set_u32(map, addr, (uint32_t)v, order);
+}
+
+static inline void
+mb_set_f32(mb_dev_registers_mapping_t* map, uint16_t addr, float v, uint8_t order) {
+  mb_set_f32s(map, addr, &v, 1, order);
+}
+
+static inline void
+mb_set_u64(mb_dev_registers_mapping_t* map, uint16_t addr, uint64_t v, uint8_t order) {
+  mb_set_u64s(map, addr, &v, 1, order);
+}
+
+static inline void
+mb_set_i64(mb_dev_registers_mapping_t* map, uint16_t addr, int64_t v, uint8_t order) {
+  mb_set_u64(map, addr, (uint64_t)v, order);
+}
+
+#if __SIZEOF_DOUBLE__ == 8
+static inline double
+mb_get_f64(const mb_dev_registers_mapping_t* map, uint16_t addr, uint8_t order) {
+  double v;
+  mb_get_f64s(map, addr, &v, 1, order);
+  return v;
+}
+
+static inline void
+mb_set_f64(mb_dev_registers_mapping_t* map, uint16_t addr, double v, uint8_t order) {
+  mb_set_f64s(map, addr, &v, 1, order);
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // MB_VALUES_H
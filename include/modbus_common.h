@@ -24,6 +24,11 @@ static inline void U16_LSB2Stream(uint16_t val, uint8_t* data) {
   *(++data) = (val & 0xff00) >> 8;
 }
 
+static inline void U32_MSB2Stream(uint32_t val, uint8_t* data) {
+  U16_MSB2Stream(val >> 16, data);
+  U16_MSB2Stream(val & 0xffff, data + 2);
+}
+
 static inline uint16_t nearestMultipleOf8(uint16_t val) {
   return (val + 7) & ~7;
 }
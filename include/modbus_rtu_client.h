@@ -1,8 +1,13 @@
 #ifndef MODBUS_RTU_CLIENT_H
 #define MODBUS_RTU_CLIENT_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 ////////////////////////////////////////////////////////////////////////////
 typedef enum mb_exception_code {
   mbec_OK = 0,
@@ -16,11 +21,57 @@ typedef enum mb_exception_code {
   mbec_gateway_path_unavailable = 0x0a,
   mbec_gateway_target_device_failed_to_respond = 0x0b,
   mbec_heap_error = 0x0c,  // hope nobody uses this
+  mbec_pending = 0xff,     // not sent. response will be completed later
 } mbec_exception_code_t;
 //////////////////////////////////////////////////////////////////////////
 
 typedef uint16_t mb_register;
 
+//diagnostic counters, see mb_get_counters. 32 bit wide, diagnostic sub
+//functions return lower 16 bits as protocol says
+typedef struct mb_counters {
+  uint32_t bus_msg;       //cpt1 bus message count
+  uint32_t bus_com_err;   //cpt2 bus communication error count
+  uint32_t exc_err;       //cpt3 slave exception error count
+  uint32_t slave_msg;     //cpt4 slave message count
+  uint32_t slave_no_resp; //cpt5 return slave no response count
+  uint32_t slave_NAK;     //cpt6 return slave NAK count
+  uint32_t slave_busy;    //cpt7 return slave busy count
+  uint32_t bus_char_overrrun; //cpt8 return bus character overrun count
+} mb_counters_t;
+
+#define MB_BROADCAST_ADDRESS 0x00
+
+//how many responses can wait for asynchronous transport. power of 2
+#ifndef MB_TX_QUEUE_LEN
+#define MB_TX_QUEUE_LEN 4
+#endif
+#define MB_MAX_ADDRESS 247
+
+//how many devices (slave addresses) one bus endpoint can emulate
+#ifndef MB_MAX_SLAVES
+#ifdef __AVR__
+#define MB_MAX_SLAVES 1
+#else
+#define MB_MAX_SLAVES MB_MAX_ADDRESS
+#endif
+#endif
+
+//counters are kept in shards, every thread handling requests increments
+//its own one without atomic operations and shared cache lines, readout
+//sums them. threads beyond MB_COUNTER_SHARDS - 1 share the last shard
+//and increment it atomically. shard isn't returned when thread exits.
+//handlers still aren't reentrant, calls from several threads must be
+//serialized. so only hosted (pthread) builds shard by default, bare metal
+//ones keep one shard and need no thread local storage.
+#ifndef MB_COUNTER_SHARDS
+#if defined(__unix__) || defined(__APPLE__)
+#define MB_COUNTER_SHARDS 8
+#else
+#define MB_COUNTER_SHARDS 1
+#endif
+#endif
+
 typedef enum mb_func_code {
   /*STANDARD FUNCTIONS*/
   /*rw coils*/
@@ -55,18 +106,69 @@ typedef enum mb_func_code {
 typedef enum mb_adu_size { mbaz_rs485 = 256, mbaz_tcp = 260 } mb_adu_size_t;
 //////////////////////////////////////////////////////////////////////////
 
+typedef enum mb_bits_flags {
+  mbbf_plain = 0x00,
+  //bits are changed with atomic operations on 64 bit words, so writes of
+  //master and application never lose each other. real_addr should be 8
+  //bytes aligned and storage should cover whole words. see mb_coils.h
+  mbbf_atomic = 0x01,
+} mb_bits_flags_t;
+
 typedef struct mb_dev_bit_mapping {
   uint16_t start_addr;
   uint16_t end_addr;
   uint8_t* real_addr;
+  uint8_t flags;          //mb_bits_flags_t
+  uint32_t* seqlock;      //not NULL if table is shared, see mb_seqlock.h
 } mb_dev_bit_mapping_t;
 
+typedef enum mb_registers_flags {
+  mbrf_host_order = 0x00,
+  mbrf_wire_order = 0x01, //real_addr keeps registers MSB first, as on the bus
+} mb_registers_flags_t;
+
 typedef struct mb_dev_registers_mapping {
   uint16_t start_addr;
   uint16_t end_addr;
   uint16_t* real_addr;
+  uint8_t flags;          //mb_registers_flags_t
+  uint32_t* seqlock;      //not NULL if table is shared, see mb_seqlock.h
 } mb_dev_registers_mapping_t;
 
+/*same layout as POSIX struct iovec, so on linux tp_sendv can pass
+ array straight to writev/sendmsg*/
+typedef struct mb_iovec {
+  void* base;
+  size_t len;
+} mb_iovec_t;
+
+typedef struct mb_frame {
+  uint8_t* data;
+  uint16_t len;
+} mb_frame_t;
+
+//device table request addresses
+typedef enum mb_table {
+  mbt_none = 0,
+  mbt_discrete_inputs,
+  mbt_coils,
+  mbt_input_registers,
+  mbt_holding_registers
+} mb_table_t;
+
+//request fields, parsed once and used by checks and execution
+typedef struct mb_request {
+  uint8_t table;        //mb_table_t
+  uint16_t address;     //start address, read part of 0x17
+  uint16_t quantity;    //bits or registers. 1 for single writes
+  uint16_t value;       //coil state, register value, and mask, sub function, mei type
+  uint16_t value2;      //or mask, diagnostic data
+  uint16_t wr_address;  //bits or registers written by request
+  uint16_t wr_quantity; //0 if request doesn't write table
+  uint8_t byte_count;
+  uint8_t *values;      //bits or registers of write requests, as on the bus
+} mb_request_t;
+
 typedef struct mb_client_device {
   uint8_t address;                                   // ID [1..247].
   mb_dev_bit_mapping_t input_discrete_map;           // read bits
@@ -74,9 +176,102 @@ typedef struct mb_client_device {
   mb_dev_registers_mapping_t input_registers_map;    // read registers
   mb_dev_registers_mapping_t holding_registers_map;  // read/write registers
   void (*tp_send)(uint8_t* data, uint16_t len);      // transport send
+  // optional vectored send. if set responses are sent as header, payload
+  // and crc without copying into one buffer. tp_send is still used for
+  // exception responses.
+  void (*tp_sendv)(const mb_iovec_t* iov, uint8_t iov_cnt);
+  // optional asynchronous send. if set responses are queued and this is
+  // called for one frame at a time. transport owns data until it calls
+  // mb_tx_complete(), it may be called from interrupt or another thread.
+  void (*tp_send_async)(uint8_t* data, uint16_t len);
+  // optional. called for valid request before it's executed, so
+  // application can refresh/apply maps. returns mbec_OK, exception code
+  // or mbec_pending. pending request is finished with mb_deferred_complete,
+  // device answers mbec_server_device_busy to other requests meanwhile.
+  uint16_t (*pf_before_execute)(struct mb_client_device* dev, uint8_t fc,
+                                uint8_t* pdu, uint8_t pdu_len);
+  // pending request older than this is answered with mbec_acknowledge
+  // (see mb_tick). 0 - never.
+  uint16_t turnaround_ms;
+  // optional. called after write request changed coils or holding
+  // registers (broadcast and deferred too), e.g. to persist tables.
+  void (*pf_after_write)(struct mb_client_device* dev, uint8_t fc);
+  // optional. called for every request which writes coils or holding
+  // registers (broadcast and deferred too) after range check, before
+  // pf_before_execute. returns mbec_OK or exception code.
+  uint16_t (*pf_check_write)(struct mb_client_device* dev,
+                             const mb_request_t* req);
+  // application data for callbacks, library doesn't use it
+  void* ctx;
 } mb_client_device_t;
 
+/*application side register accessors. work with both storage orders*/
+static inline uint16_t
+mb_register_get(const mb_dev_registers_mapping_t* map, uint16_t addr) {
+  const uint8_t* p;
+  if (!(map->flags & mbrf_wire_order))
+    return map->real_addr[addr];
+  p = (const uint8_t*)&map->real_addr[addr];
+  return (p[0] << 8) | p[1];
+}
+
+static inline void
+mb_register_set(mb_dev_registers_mapping_t* map, uint16_t addr, uint16_t val) {
+  uint8_t* p;
+  if (!(map->flags & mbrf_wire_order)) {
+    map->real_addr[addr] = val;
+    return;
+  }
+  p = (uint8_t*)&map->real_addr[addr];
+  p[0] = val >> 8;
+  p[1] = val & 0xff;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//resets address table and registers dev as the first device
 void mb_init(mb_client_device_t* dev);
+//one more device on the same bus. returns mbec_OK or
+//mbec_illegal_data_address if address is wrong or already taken,
+//mbec_heap_error if there are already MB_MAX_SLAVES devices.
+uint16_t mb_add_device(mb_client_device_t* dev);
+//same as diagnostic sub function 0x04 (force listen only mode) when on.
+//device leaves listen only mode on restart communications option request.
+uint16_t mb_set_listen_only(uint8_t address, uint8_t on);
+//sums counters of device with address, bus wide ones are the same for all.
+//can be called from any thread. returns mbec_illegal_data_address if
+//nobody answers address.
+uint16_t mb_get_counters(uint8_t address, mb_counters_t* dst);
+//request handlers (mb_handle_request, mb_handle_requests,
+//mb_deferred_complete, mb_tick) aren't reentrant : device is selected for
+//the whole request. if several threads call them, serialize the calls.
 uint16_t mb_handle_request(uint8_t* data, uint16_t data_len);
+//handles frames in one pass. responses are not sent with tp_send, they are
+//written one after another into arena and responses[i] points to the
+//answer for frames[i] (len 0 means no answer). stops when arena can't
+//hold one more max size response, returns number of handled frames.
+uint16_t mb_handle_requests(mb_frame_t* frames, uint16_t n,
+                            mb_frame_t* responses,
+                            uint8_t* arena, uint32_t arena_len);
+
+//finishes request deferred by pf_before_execute. result is mbec_OK to
+//execute and answer request or exception code to answer with. other
+//values (mbec_pending included) return mbec_illegal_data_value and
+//request stays deferred.
+//should be called from the same context as mb_handle_request.
+uint16_t mb_deferred_complete(uint8_t address, uint16_t result);
+//time source for turnaround timeouts of deferred requests
+void mb_tick(uint16_t elapsed_ms);
+
+//transport finished sending frame passed to tp_send_async.
+//starts next queued frame if there is one.
+void mb_tx_complete();
+//frames which are queued or on the wire
+uint8_t mb_tx_pending();
+//frees buffers of completed frames. called by mb_handle_request too.
+void mb_tx_reclaim();
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif  // MODBUS_RTU_CLIENT_H
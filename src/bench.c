@@ -0,0 +1,435 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "commons.h"
+#include "heap_memory.h"
+#include "modbus_common.h"
+#include "modbus_rtu_client.h"
+
+/*
+ * Microbenchmarks for the request path, the heap and crc16.
+ * Every case is measured as BENCH_SAMPLES samples of `iters` operations,
+ * one CSV row per case :
+ * group,case,param,samples,iters,min_ns,median_ns,p99_ns
+ * all *_ns values are nanoseconds per single operation.
+ */
+
+#define BENCH_SAMPLES 201
+#define BENCH_DEV_ADDR 0x01
+#define BENCH_BITS_BYTES 256
+#define BENCH_REGISTERS 256
+
+static uint8_t m_input_discrete[BENCH_BITS_BYTES];
+static uint8_t m_coils[BENCH_BITS_BYTES] __attribute__((aligned(8))); //mbbf_atomic ready
+static uint16_t m_input_registers[BENCH_REGISTERS];
+static uint16_t m_holding_registers[BENCH_REGISTERS];
+static mb_client_device_t m_dev;
+
+static volatile uint32_t m_sink = 0; //keeps results alive
+static double m_samples[BENCH_SAMPLES];
+
+static inline uint64_t
+now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+cmp_double(const void *l, const void *r) {
+  double a = *(const double*)l, b = *(const double*)r;
+  return (a > b) - (a < b);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+report(const char *group, const char *name, uint32_t param, uint32_t iters) {
+  uint32_t p99 = (BENCH_SAMPLES * 99) / 100;
+  qsort(m_samples, BENCH_SAMPLES, sizeof(double), cmp_double);
+  printf("%s,%s,%u,%u,%u,%.1f,%.1f,%.1f\n", group, name, param,
+         BENCH_SAMPLES, iters, m_samples[0],
+         m_samples[BENCH_SAMPLES / 2], m_samples[p99]);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+send_sink(uint8_t *data, uint16_t len) {
+  m_sink += data[len - 1];
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+sendv_sink(const mb_iovec_t *iov, uint8_t iov_cnt) {
+  const mb_iovec_t *last = &iov[iov_cnt - 1];
+  m_sink += ((uint8_t*)last->base)[last->len - 1];
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+bench_device_init() {
+  uint16_t i;
+  for (i = 0; i < BENCH_BITS_BYTES; ++i) {
+    m_input_discrete[i] = (uint8_t)(i * 7);
+    m_coils[i] = (uint8_t)(i * 13);
+  }
+  for (i = 0; i < BENCH_REGISTERS; ++i) {
+    m_input_registers[i] = i;
+    m_holding_registers[i] = i ^ 0x5a5a;
+  }
+
+  m_dev.address = BENCH_DEV_ADDR;
+  m_dev.input_discrete_map.start_addr = 0;
+  m_dev.input_discrete_map.end_addr = BENCH_BITS_BYTES;
+  m_dev.input_discrete_map.real_addr = m_input_discrete;
+  m_dev.coils_map.start_addr = 0;
+  m_dev.coils_map.end_addr = BENCH_BITS_BYTES;
+  m_dev.coils_map.real_addr = m_coils;
+  m_dev.input_registers_map.start_addr = 0;
+  m_dev.input_registers_map.end_addr = BENCH_REGISTERS;
+  m_dev.input_registers_map.real_addr = m_input_registers;
+  m_dev.holding_registers_map.start_addr = 0;
+  m_dev.holding_registers_map.end_addr = BENCH_REGISTERS;
+  m_dev.holding_registers_map.real_addr = m_holding_registers;
+  m_dev.tp_send = send_sink;
+
+  hm_init();
+  mb_init(&m_dev);
+}
+//////////////////////////////////////////////////////////////////////////
+
+/*frame builders. all return whole frame length including crc*/
+
+static uint16_t
+frame_finish(uint8_t *frame, uint16_t len) {
+  U16_LSB2Stream(crc16(frame, len), frame + len);
+  return len + 2;
+}
+
+static uint16_t
+frame_addr_val(uint8_t *frame, uint8_t fc, uint16_t addr, uint16_t val) {
+  frame[0] = BENCH_DEV_ADDR;
+  frame[1] = fc;
+  U16_MSB2Stream(addr, frame + 2);
+  U16_MSB2Stream(val, frame + 4);
+  return frame_finish(frame, 6);
+}
+
+static uint16_t
+frame_write_multiple_coils(uint8_t *frame, uint16_t quantity) {
+  uint8_t i, bc = nearestMultipleOf8(quantity) / 8;
+  frame[0] = BENCH_DEV_ADDR;
+  frame[1] = mbfc_write_multiple_coils;
+  U16_MSB2Stream(0, frame + 2);
+  U16_MSB2Stream(quantity, frame + 4);
+  frame[6] = bc;
+  for (i = 0; i < bc; ++i)
+    frame[7 + i] = 0xa5 ^ i;
+  return frame_finish(frame, 7 + bc);
+}
+
+static uint16_t
+frame_write_multiple_registers(uint8_t *frame, uint16_t quantity) {
+  uint16_t i;
+  frame[0] = BENCH_DEV_ADDR;
+  frame[1] = mbfc_write_multiple_registers;
+  U16_MSB2Stream(0, frame + 2);
+  U16_MSB2Stream(quantity, frame + 4);
+  frame[6] = (uint8_t)(quantity * 2);
+  for (i = 0; i < quantity; ++i)
+    U16_MSB2Stream(i, frame + 7 + i * 2);
+  return frame_finish(frame, 7 + quantity * 2);
+}
+
+static uint16_t
+frame_mask_write(uint8_t *frame) {
+  frame[0] = BENCH_DEV_ADDR;
+  frame[1] = mbfc_mask_write_registers;
+  U16_MSB2Stream(4, frame + 2);
+  U16_MSB2Stream(0xf2f2, frame + 4);
+  U16_MSB2Stream(0x2525, frame + 6);
+  return frame_finish(frame, 8);
+}
+
+static uint16_t
+frame_report_device_id(uint8_t *frame) {
+  frame[0] = BENCH_DEV_ADDR;
+  frame[1] = mbfc_report_device_id;
+  return frame_finish(frame, 2);
+}
+//////////////////////////////////////////////////////////////////////////
+
+/*handlers modify request in place (write multiple coils), so every
+ iteration works on a fresh copy of the frame. copy is part of the cost
+ for every case, so results stay comparable with each other*/
+static void
+bench_request(const char *name, uint32_t param,
+              const uint8_t *frame, uint16_t len, uint32_t iters) {
+  uint8_t work[mbaz_rs485];
+  uint32_t s, i;
+  uint64_t t0;
+
+  for (i = 0; i < iters; ++i) { //warm up
+    memcpy(work, frame, len);
+    m_sink += mb_handle_request(work, len);
+  }
+
+  for (s = 0; s < BENCH_SAMPLES; ++s) {
+    t0 = now_ns();
+    for (i = 0; i < iters; ++i) {
+      memcpy(work, frame, len);
+      m_sink += mb_handle_request(work, len);
+    }
+    m_samples[s] = (double)(now_ns() - t0) / iters;
+  }
+  report("request", name, param, iters);
+}
+//////////////////////////////////////////////////////////////////////////
+
+//same frames as bench_request, but handed over in batches
+static void
+bench_batch(const char *name, uint32_t param,
+            const uint8_t *frame, uint16_t len, uint32_t iters) {
+  enum { batch = 32 };
+  static uint8_t work[batch][mbaz_rs485];
+  static uint8_t arena[batch * mbaz_tcp];
+  mb_frame_t frames[batch], responses[batch];
+  uint32_t s, i, k;
+  uint64_t t0;
+
+  for (k = 0; k < batch; ++k) {
+    frames[k].data = work[k];
+    frames[k].len = len;
+  }
+
+  for (s = 0; s < BENCH_SAMPLES; ++s) {
+    t0 = now_ns();
+    for (i = 0; i < iters; i += batch) {
+      for (k = 0; k < batch; ++k)
+        memcpy(work[k], frame, len);
+      m_sink += mb_handle_requests(frames, batch, responses, arena, sizeof(arena));
+    }
+    m_samples[s] = (double)(now_ns() - t0) / iters;
+  }
+  report("batch", name, param, iters);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+bench_requests() {
+  enum { iters = 2000 };
+  static const uint16_t bit_quantities[] = {8, 256, 1968};
+  static const uint16_t reg_quantities[] = {1, 16, 125};
+  static const uint16_t wreg_quantities[] = {1, 16, 121};
+  uint8_t frame[mbaz_rs485];
+  uint16_t len;
+  uint8_t i;
+
+  for (i = 0; i < sizeof(bit_quantities) / sizeof(bit_quantities[0]); ++i) {
+    len = frame_addr_val(frame, mbfc_read_coils, 0, bit_quantities[i]);
+    bench_request("read_coils", bit_quantities[i], frame, len, iters);
+    len = frame_addr_val(frame, mbfc_read_discrete_input, 3, bit_quantities[i]);
+    bench_request("read_discrete_inputs", bit_quantities[i], frame, len, iters);
+    len = frame_write_multiple_coils(frame, bit_quantities[i]);
+    bench_request("write_multiple_coils", bit_quantities[i], frame, len, iters);
+  }
+
+  for (i = 0; i < sizeof(reg_quantities) / sizeof(reg_quantities[0]); ++i) {
+    len = frame_addr_val(frame, mbfc_read_holding_registers, 0, reg_quantities[i]);
+    bench_request("read_holding_registers", reg_quantities[i], frame, len, iters);
+    len = frame_addr_val(frame, mbfc_read_input_registers, 0, reg_quantities[i]);
+    bench_request("read_input_registers", reg_quantities[i], frame, len, iters);
+  }
+
+  for (i = 0; i < sizeof(wreg_quantities) / sizeof(wreg_quantities[0]); ++i) {
+    len = frame_write_multiple_registers(frame, wreg_quantities[i]);
+    bench_request("write_multiple_registers", wreg_quantities[i], frame, len, iters);
+  }
+
+  m_dev.coils_map.flags = mbbf_atomic;
+  for (i = 0; i < sizeof(bit_quantities) / sizeof(bit_quantities[0]); ++i) {
+    len = frame_write_multiple_coils(frame, bit_quantities[i]);
+    bench_request("write_multiple_coils_atomic", bit_quantities[i], frame, len, iters);
+  }
+  m_dev.coils_map.flags = mbbf_plain;
+
+  m_dev.holding_registers_map.flags = mbrf_wire_order;
+  for (i = 0; i < sizeof(reg_quantities) / sizeof(reg_quantities[0]); ++i) {
+    len = frame_addr_val(frame, mbfc_read_holding_registers, 0, reg_quantities[i]);
+    bench_request("read_holding_registers_wire", reg_quantities[i], frame, len, iters);
+  }
+  for (i = 0; i < sizeof(wreg_quantities) / sizeof(wreg_quantities[0]); ++i) {
+    len = frame_write_multiple_registers(frame, wreg_quantities[i]);
+    bench_request("write_multiple_registers_wire", wreg_quantities[i], frame, len, iters);
+  }
+  m_dev.holding_registers_map.flags = mbrf_host_order;
+
+  m_dev.tp_sendv = sendv_sink;
+  for (i = 0; i < sizeof(reg_quantities) / sizeof(reg_quantities[0]); ++i) {
+    len = frame_addr_val(frame, mbfc_read_holding_registers, 0, reg_quantities[i]);
+    bench_request("read_holding_registers_sendv", reg_quantities[i], frame, len, iters);
+  }
+  m_dev.tp_sendv = NULL;
+
+  for (i = 0; i < sizeof(reg_quantities) / sizeof(reg_quantities[0]); ++i) {
+    len = frame_addr_val(frame, mbfc_read_holding_registers, 0, reg_quantities[i]);
+    bench_batch("read_holding_registers", reg_quantities[i], frame, len, iters);
+  }
+
+  len = frame_addr_val(frame, mbfc_write_single_coil, 17, 0xff00);
+  bench_request("write_single_coil", 1, frame, len, iters);
+  len = frame_addr_val(frame, mbfc_write_single_register, 17, 0x1234);
+  bench_request("write_single_register", 1, frame, len, iters);
+  len = frame_mask_write(frame);
+  bench_request("mask_write_register", 1, frame, len, iters);
+  len = frame_addr_val(frame, mbfc_diagnostic, 0x000b, 0); //bus messages count
+  bench_request("diagnostic", 0x0b, frame, len, iters);
+  len = frame_report_device_id(frame);
+  bench_request("report_device_id", 0, frame, len, iters);
+
+  len = frame_addr_val(frame, mbfc_read_holding_registers, 0, 125);
+  frame[len - 1] ^= 0xff;
+  bench_request("crc_error", 125, frame, len, iters);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static inline uint32_t
+xorshift32(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//same size malloc/free pair on empty heap. best case.
+static void
+bench_heap_lifo(uint16_t size) {
+  enum { iters = 10000 };
+  uint32_t s, i;
+  uint64_t t0;
+  memory_t p;
+
+  hm_init();
+  for (s = 0; s < BENCH_SAMPLES; ++s) {
+    t0 = now_ns();
+    for (i = 0; i < iters; ++i) {
+      p = hm_malloc(size);
+      hm_free(p);
+    }
+    m_samples[s] = (double)(now_ns() - t0) / iters;
+  }
+  report("heap", "lifo", size, iters);
+}
+//////////////////////////////////////////////////////////////////////////
+
+//fill heap with small blocks, free every second one, then ask for a block
+//that doesn't fit any hole. first-fit has to walk the whole list.
+static void
+bench_heap_holes(uint16_t size) {
+  enum { iters = 1000, max_blocks = 256, small = 8 };
+  memory_t blocks[max_blocks];
+  uint32_t s, i, n;
+  uint64_t t0;
+  memory_t p;
+
+  hm_init();
+  for (n = 0; n < max_blocks && (blocks[n] = hm_malloc(small)); ++n)
+    ;
+  for (i = 0; i < n; i += 2)
+    hm_free(blocks[i]);
+  //give some room at the end for the large block
+  for (i = (n / 2) | 1; i < n; i += 2)
+    hm_free(blocks[i]);
+
+  for (s = 0; s < BENCH_SAMPLES; ++s) {
+    t0 = now_ns();
+    for (i = 0; i < iters; ++i) {
+      if ((p = hm_malloc(size)))
+        hm_free(p);
+      m_sink += (uint32_t)p;
+    }
+    m_samples[s] = (double)(now_ns() - t0) / iters;
+  }
+  report("heap", "holes", size, iters);
+}
+//////////////////////////////////////////////////////////////////////////
+
+//random sizes up to max_size, random order of frees. simulates mix of
+//adu, payload and send buffers living together.
+static void
+bench_heap_random(uint16_t max_size) {
+  enum { iters = 2000, slots = 16 };
+  memory_t live[slots] = {0};
+  uint32_t rnd = 0x12345678u;
+  uint32_t s, i, k;
+  uint64_t t0;
+
+  hm_init();
+  for (s = 0; s < BENCH_SAMPLES; ++s) {
+    t0 = now_ns();
+    for (i = 0; i < iters; ++i) {
+      k = xorshift32(&rnd) % slots;
+      if (live[k]) {
+        hm_free(live[k]);
+        live[k] = 0;
+      } else {
+        live[k] = hm_malloc(1 + xorshift32(&rnd) % max_size);
+      }
+    }
+    m_samples[s] = (double)(now_ns() - t0) / iters;
+  }
+  for (k = 0; k < slots; ++k)
+    if (live[k]) hm_free(live[k]);
+  report("heap", "random", max_size, iters);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+bench_heap() {
+  bench_heap_lifo(8);
+  bench_heap_lifo(256);
+  bench_heap_holes(64);
+  bench_heap_holes(256);
+  bench_heap_random(16);
+  bench_heap_random(128);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+bench_crc16() {
+  enum { iters = 2000 };
+  static const uint16_t sizes[] = {8, 64, 256};
+  uint8_t buff[256];
+  uint32_t s, i;
+  uint64_t t0;
+  uint8_t k;
+
+  for (i = 0; i < sizeof(buff); ++i)
+    buff[i] = (uint8_t)(i * 31);
+
+  for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+    for (s = 0; s < BENCH_SAMPLES; ++s) {
+      t0 = now_ns();
+      for (i = 0; i < iters; ++i)
+        m_sink += crc16(buff, sizes[k]);
+      m_samples[s] = (double)(now_ns() - t0) / iters;
+    }
+    report("crc16", "bytes", sizes[k], iters);
+  }
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+main() {
+  printf("group,case,param,samples,iters,min_ns,median_ns,p99_ns\n");
+  bench_device_init();
+  bench_requests();
+  bench_heap();
+  bench_crc16();
+  return m_sink == 0xffffffffu; //never true, but compiler doesn't know
+}
@@ -0,0 +1,688 @@
+#define _GNU_SOURCE //ppoll
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "commons.h"
+#include "heap_memory.h"
+#include "modbus_common.h"
+#include "modbus_rtu_client.h"
+
+/*
+ * Bus simulator and load generator.
+ * Creates pseudo terminal pair for every slave and forks slave process
+ * (address 1..N) behind its slave end. Master side keeps one transaction
+ * in flight on every line and drives random request mix.
+ * With -b frames are paced as on the wire (11 bits per character) and
+ * frames are delimited by 3.5 characters of silence.
+ * -e corrupts one bit of some requests, slave must count them as bus
+ * communication errors and keep silent.
+ * At the end diagnostic counters of every slave are compared with
+ * what master sent.
+ */
+
+#define BUSIM_MAX_SLAVES 32
+#define BUSIM_BITS_BYTES 256    //2048 bits
+#define BUSIM_REGISTERS 1024
+#define BUSIM_MAX_LATENCIES (1u << 20)
+
+typedef struct busim_cfg {
+  uint32_t baud;          //0 - no pacing
+  uint32_t err_permille;  //corrupted requests
+  uint32_t timeout_us;    //response timeout
+  uint32_t duration_ms;
+  uint32_t requests;      //0 - only duration limits the run
+  uint16_t max_quantity;  //registers, bits are 8 times more
+  uint8_t slaves;
+  uint16_t mix[256];      //weight of function code
+  uint32_t mix_total;
+} busim_cfg_t;
+
+typedef enum line_state {
+  ls_idle = 0,  //next request is sent at due_ns
+  ls_tx,        //request is "on the wire" till due_ns
+  ls_rx         //waiting for response till due_ns
+} line_state_t;
+
+typedef struct busim_line {
+  int fd;
+  pid_t pid;
+  uint8_t address;
+  uint8_t state;
+  uint8_t corrupted;      //current request is corrupted, no answer expected
+  uint8_t req[mbaz_rs485];
+  uint16_t req_len;
+  uint8_t resp[mbaz_tcp];
+  uint16_t resp_len;
+  uint16_t resp_expected;
+  uint64_t start_ns;
+  uint64_t due_ns;
+  //what slave should have counted
+  uint32_t sent_valid;
+  uint32_t sent_corrupted;
+} busim_line_t;
+
+typedef struct busim_stat {
+  uint64_t transactions;
+  uint64_t ok;
+  uint64_t exceptions;
+  uint64_t timeouts;      //valid request without answer
+  uint64_t bad_responses; //crc, address, function or length mismatch
+  uint64_t corrupted;
+} busim_stat_t;
+
+static busim_cfg_t m_cfg;
+static busim_line_t m_lines[BUSIM_MAX_SLAVES];
+static busim_stat_t m_stat = {0};
+static uint32_t *m_latencies = NULL; //ns
+static uint32_t m_latencies_count = 0;
+static uint64_t m_rnd = 0x9e3779b97f4a7c15ull;
+
+static inline uint64_t
+now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static inline uint32_t
+rnd() {
+  m_rnd ^= m_rnd << 13;
+  m_rnd ^= m_rnd >> 7;
+  m_rnd ^= m_rnd << 17;
+  return (uint32_t)(m_rnd >> 16);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static inline uint32_t
+rnd_range(uint32_t lo, uint32_t hi) { //[lo, hi]
+  return lo + rnd() % (hi - lo + 1);
+}
+//////////////////////////////////////////////////////////////////////////
+
+//time of len characters on the wire
+static inline uint64_t
+wire_ns(uint16_t len) {
+  return m_cfg.baud ? (uint64_t)len * 11u * 1000000000u / m_cfg.baud : 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//3.5 characters, fixed 1750us above 19200 as specification says
+static inline uint64_t
+t35_ns() {
+  if (!m_cfg.baud) return 100000u;
+  if (m_cfg.baud > 19200) return 1750000u;
+  return wire_ns(7) / 2;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static inline struct timespec
+ns_to_ts(uint64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000u;
+  ts.tv_nsec = ns % 1000000000u;
+  return ts;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+sleep_ns(uint64_t ns) {
+  struct timespec ts = ns_to_ts(ns);
+  while (nanosleep(&ts, &ts) && errno == EINTR)
+    ;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+write_all(int fd, const uint8_t *data, uint16_t len) {
+  ssize_t n;
+  while (len) {
+    if ((n = write(fd, data, len)) < 0) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      return -1;
+    }
+    data += n;
+    len -= (uint16_t)n;
+  }
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+/*slave process*/
+
+static int m_slave_fd = -1;
+
+static void
+slave_send(uint8_t *data, uint16_t len) {
+  sleep_ns(wire_ns(len));
+  write_all(m_slave_fd, data, len);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+slave_run(int fd, uint8_t address) {
+  static uint8_t input_discrete[BUSIM_BITS_BYTES];
+  static uint8_t coils[BUSIM_BITS_BYTES];
+  static uint16_t input_registers[BUSIM_REGISTERS];
+  static uint16_t holding_registers[BUSIM_REGISTERS];
+  static mb_client_device_t dev;
+  uint8_t frame[mbaz_tcp];
+  uint16_t len = 0;
+  struct pollfd pfd = {fd, POLLIN, 0};
+  struct timespec t35;
+  int n;
+  uint16_t i;
+
+  for (i = 0; i < BUSIM_REGISTERS; ++i)
+    input_registers[i] = i;
+
+  m_slave_fd = fd;
+  dev.address = address;
+  dev.input_discrete_map.end_addr = BUSIM_BITS_BYTES;
+  dev.input_discrete_map.real_addr = input_discrete;
+  dev.coils_map.end_addr = BUSIM_BITS_BYTES;
+  dev.coils_map.real_addr = coils;
+  dev.input_registers_map.end_addr = BUSIM_REGISTERS;
+  dev.input_registers_map.real_addr = input_registers;
+  dev.holding_registers_map.end_addr = BUSIM_REGISTERS;
+  dev.holding_registers_map.real_addr = holding_registers;
+  dev.tp_send = slave_send;
+  hm_init();
+  mb_init(&dev);
+
+  //frame ends after 3.5 characters of silence
+  t35 = ns_to_ts(t35_ns());
+  for (;;) {
+    n = ppoll(&pfd, 1, len ? &t35 : NULL, NULL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    if (n == 0) {
+      mb_handle_request(frame, len);
+      len = 0;
+      continue;
+    }
+
+    if (pfd.revents & (POLLHUP | POLLERR)) break;
+    n = (int)read(fd, frame + len, sizeof(frame) - len);
+    if (n <= 0) {
+      if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+      break;
+    }
+    len += (uint16_t)n;
+    if (len == sizeof(frame)) len = 0; //garbage, drop it
+  }
+  _exit(0);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+line_open(busim_line_t *line, uint8_t address) {
+  struct termios tio;
+  const char *name;
+  int sfd;
+
+  if ((line->fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0)
+    return -1;
+  if (grantpt(line->fd) || unlockpt(line->fd) ||
+      !(name = ptsname(line->fd)) ||
+      (sfd = open(name, O_RDWR | O_NOCTTY)) < 0) {
+    close(line->fd);
+    return -1;
+  }
+
+  tcgetattr(sfd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(sfd, TCSANOW, &tio);
+
+  line->address = address;
+  if ((line->pid = fork()) < 0) {
+    close(sfd);
+    close(line->fd);
+    return -1;
+  }
+
+  if (!line->pid) {
+    close(line->fd);
+    slave_run(sfd, address);
+  }
+
+  close(sfd);
+  fcntl(line->fd, F_SETFL, fcntl(line->fd, F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+line_close(busim_line_t *line) {
+  kill(line->pid, SIGTERM);
+  waitpid(line->pid, NULL, 0);
+  close(line->fd);
+}
+//////////////////////////////////////////////////////////////////////////
+
+/*master side*/
+
+static uint16_t
+frame_finish(uint8_t *frame, uint16_t len) {
+  U16_LSB2Stream(crc16(frame, len), frame + len);
+  return len + 2;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static uint8_t
+mix_pick() {
+  uint32_t r = rnd() % m_cfg.mix_total;
+  uint16_t fc;
+  for (fc = 0; fc < 256; ++fc) {
+    if (r < m_cfg.mix[fc]) break;
+    r -= m_cfg.mix[fc];
+  }
+  return (uint8_t)fc;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//builds random request of mix, sets expected response length
+static void
+request_build(busim_line_t *line) {
+  uint8_t *f = line->req;
+  uint8_t fc = mix_pick();
+  uint16_t q, bc, i;
+  uint16_t bits = BUSIM_BITS_BYTES * 8;
+  uint16_t qbits = m_cfg.max_quantity * 8;
+
+  f[0] = line->address;
+  f[1] = fc;
+  switch (fc) {
+    case mbfc_read_coils:
+    case mbfc_read_discrete_input:
+      q = (uint16_t)rnd_range(1, qbits > 0x07d0 ? 0x07d0 : qbits);
+      U16_MSB2Stream((uint16_t)rnd_range(0, bits - q), f + 2);
+      U16_MSB2Stream(q, f + 4);
+      line->req_len = frame_finish(f, 6);
+      line->resp_expected = 5 + nearestMultipleOf8(q) / 8;
+      break;
+    case mbfc_read_holding_registers:
+    case mbfc_read_input_registers:
+      q = (uint16_t)rnd_range(1, m_cfg.max_quantity > 0x7d ? 0x7d : m_cfg.max_quantity);
+      U16_MSB2Stream((uint16_t)rnd_range(0, BUSIM_REGISTERS - q), f + 2);
+      U16_MSB2Stream(q, f + 4);
+      line->req_len = frame_finish(f, 6);
+      line->resp_expected = 5 + q * 2;
+      break;
+    case mbfc_write_single_coil:
+      U16_MSB2Stream((uint16_t)rnd_range(0, bits - 1), f + 2);
+      U16_MSB2Stream(rnd() & 1 ? 0xff00 : 0x0000, f + 4);
+      line->req_len = frame_finish(f, 6);
+      line->resp_expected = 8;
+      break;
+    case mbfc_write_single_register:
+      U16_MSB2Stream((uint16_t)rnd_range(0, BUSIM_REGISTERS - 1), f + 2);
+      U16_MSB2Stream((uint16_t)rnd(), f + 4);
+      line->req_len = frame_finish(f, 6);
+      line->resp_expected = 8;
+      break;
+    case mbfc_write_multiple_coils:
+      q = (uint16_t)rnd_range(1, qbits > 0x07b0 ? 0x07b0 : qbits);
+      bc = nearestMultipleOf8(q) / 8;
+      U16_MSB2Stream((uint16_t)rnd_range(0, bits - q), f + 2);
+      U16_MSB2Stream(q, f + 4);
+      f[6] = (uint8_t)bc;
+      for (i = 0; i < bc; ++i)
+        f[7 + i] = (uint8_t)rnd();
+      line->req_len = frame_finish(f, 7 + bc);
+      line->resp_expected = 8;
+      break;
+    case mbfc_write_multiple_registers:
+    default:
+      f[1] = mbfc_write_multiple_registers;
+      q = (uint16_t)rnd_range(1, m_cfg.max_quantity > 0x7b ? 0x7b : m_cfg.max_quantity);
+      U16_MSB2Stream((uint16_t)rnd_range(0, BUSIM_REGISTERS - q), f + 2);
+      U16_MSB2Stream(q, f + 4);
+      f[6] = (uint8_t)(q * 2);
+      for (i = 0; i < q * 2; ++i)
+        f[7 + i] = (uint8_t)rnd();
+      line->req_len = frame_finish(f, 7 + q * 2);
+      line->resp_expected = 8;
+      break;
+  }
+
+  line->corrupted = m_cfg.err_permille && rnd() % 1000 < m_cfg.err_permille;
+  if (line->corrupted) //one bit error, crc16 always detects it
+    line->req[rnd() % line->req_len] ^= (uint8_t)(1u << (rnd() % 8));
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+line_flush(busim_line_t *line) {
+  uint8_t buff[256];
+  while (read(line->fd, buff, sizeof(buff)) > 0)
+    ;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+latency_add(uint64_t ns) {
+  if (m_latencies_count == BUSIM_MAX_LATENCIES) return;
+  m_latencies[m_latencies_count++] = ns > 0xffffffffu ? 0xffffffffu : (uint32_t)ns;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//response is complete when expected length (or exception length) is read
+static uint8_t
+response_complete(const busim_line_t *line) {
+  if (line->resp_len >= 2 && (line->resp[1] & 0x80))
+    return line->resp_len >= 5;
+  return line->resp_len >= line->resp_expected;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+response_check(busim_line_t *line, uint64_t now) {
+  const uint8_t *r = line->resp;
+  uint16_t len = line->resp_len;
+  uint8_t valid = len >= 5 && r[0] == line->address &&
+      (r[1] & 0x7f) == line->req[1] &&
+      U16_LSBFromStream((uint8_t*)r + len - 2) == crc16((uint8_t*)r, len - 2);
+
+  ++m_stat.transactions;
+  if (!valid) ++m_stat.bad_responses;
+  else if (r[1] & 0x80) ++m_stat.exceptions;
+  else ++m_stat.ok;
+  latency_add(now - line->start_ns);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+line_start(busim_line_t *line, uint64_t now) {
+  request_build(line);
+  line->start_ns = now;
+  line->due_ns = now + wire_ns(line->req_len);
+  line->state = ls_tx;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+line_step(busim_line_t *line, uint64_t now, uint8_t readable, uint8_t stopping) {
+  ssize_t n;
+
+  switch (line->state) {
+    case ls_idle:
+      if (stopping || now < line->due_ns) return;
+      line_start(line, now);
+      return;
+
+    case ls_tx:
+      if (now < line->due_ns) return;
+      write_all(line->fd, line->req, line->req_len);
+      if (line->corrupted) ++line->sent_corrupted;
+      else ++line->sent_valid;
+      line->resp_len = 0;
+      line->due_ns = now + (uint64_t)m_cfg.timeout_us * 1000u;
+      line->state = ls_rx;
+      return;
+
+    case ls_rx:
+      if (readable) {
+        n = read(line->fd, line->resp + line->resp_len,
+                 sizeof(line->resp) - line->resp_len);
+        if (n > 0) line->resp_len += (uint16_t)n;
+        if (response_complete(line)) {
+          response_check(line, now);
+          line->state = ls_idle;
+          line->due_ns = now + t35_ns();
+          return;
+        }
+      }
+      if (now < line->due_ns) return;
+      //no (complete) answer
+      if (line->corrupted) {
+        ++m_stat.corrupted;
+      } else {
+        ++m_stat.transactions;
+        ++m_stat.timeouts;
+      }
+      line_flush(line);
+      line->state = ls_idle;
+      line->due_ns = now + t35_ns();
+      return;
+  }
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+load_run() {
+  struct pollfd pfd[BUSIM_MAX_SLAVES];
+  uint64_t now = now_ns(), end = now + (uint64_t)m_cfg.duration_ms * 1000000u;
+  uint64_t next;
+  struct timespec timeout;
+  uint8_t i, active, stopping = 0;
+
+  for (i = 0; i < m_cfg.slaves; ++i) {
+    m_lines[i].state = ls_idle;
+    m_lines[i].due_ns = now;
+    pfd[i].fd = m_lines[i].fd;
+  }
+
+  for (;;) {
+    now = now_ns();
+    stopping = stopping || now >= end ||
+        (m_cfg.requests && m_stat.transactions + m_stat.corrupted >= m_cfg.requests);
+
+    next = UINT64_MAX;
+    active = 0;
+    for (i = 0; i < m_cfg.slaves; ++i) {
+      busim_line_t *line = &m_lines[i];
+      pfd[i].events = line->state == ls_rx ? POLLIN : 0;
+      pfd[i].revents = 0;
+      if (line->state != ls_idle) ++active;
+      if (line->state == ls_idle && stopping) continue;
+      if (line->due_ns < next) next = line->due_ns;
+    }
+    if (stopping && !active) break;
+
+    timeout = ns_to_ts(next <= now ? 0 : next - now);
+    if (ppoll(pfd, m_cfg.slaves, &timeout, NULL) < 0 && errno != EINTR)
+      break;
+
+    now = now_ns();
+    for (i = 0; i < m_cfg.slaves; ++i)
+      line_step(&m_lines[i], now, (pfd[i].revents & POLLIN) != 0, stopping);
+  }
+}
+//////////////////////////////////////////////////////////////////////////
+
+//synchronous diagnostic request. returns counter or -1
+static int32_t
+diag_counter(busim_line_t *line, uint16_t sub_function) {
+  struct pollfd pfd = {line->fd, POLLIN, 0};
+  uint64_t deadline;
+  ssize_t n;
+
+  line->req[0] = line->address;
+  line->req[1] = mbfc_diagnostic;
+  U16_MSB2Stream(sub_function, line->req + 2);
+  U16_MSB2Stream(0, line->req + 4);
+  line->req_len = frame_finish(line->req, 6);
+  line->resp_expected = 8;
+  line->resp_len = 0;
+
+  sleep_ns(t35_ns() + wire_ns(line->req_len));
+  write_all(line->fd, line->req, line->req_len);
+  deadline = now_ns() + (uint64_t)m_cfg.timeout_us * 1000u;
+  while (!response_complete(line) && now_ns() < deadline) {
+    if (poll(&pfd, 1, (int)(m_cfg.timeout_us / 1000u) + 1) <= 0) continue;
+    n = read(line->fd, line->resp + line->resp_len, sizeof(line->resp) - line->resp_len);
+    if (n > 0) line->resp_len += (uint16_t)n;
+  }
+
+  if (line->resp_len != 8 || line->resp[1] != mbfc_diagnostic ||
+      U16_LSBFromStream(line->resp + 6) != crc16(line->resp, 6))
+    return -1;
+  return U16_MSBFromStream(line->resp + 4);
+}
+//////////////////////////////////////////////////////////////////////////
+
+//counters are 16 bit, so everything is compared modulo 65536
+static uint8_t
+counters_check(busim_line_t *line) {
+  int32_t bus_msg, com_err, srv_msg;
+  //every diagnostic request is counted before it's answered
+  bus_msg = diag_counter(line, 0x0b);
+  com_err = diag_counter(line, 0x0c);
+  srv_msg = diag_counter(line, 0x0e);
+
+  printf("slave=%u sent_valid=%u sent_corrupted=%u bus_msg=%d bus_com_err=%d "
+         "server_msg=%d\n", line->address, line->sent_valid, line->sent_corrupted,
+         bus_msg, com_err, srv_msg);
+  return bus_msg == (int32_t)((line->sent_valid + 1) & 0xffff) &&
+      com_err == (int32_t)(line->sent_corrupted & 0xffff) &&
+      srv_msg == (int32_t)((line->sent_valid + 3) & 0xffff);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+cmp_u32(const void *l, const void *r) {
+  uint32_t a = *(const uint32_t*)l, b = *(const uint32_t*)r;
+  return (a > b) - (a < b);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static double
+percentile_us(double p) {
+  uint32_t idx;
+  if (!m_latencies_count) return 0.0;
+  idx = (uint32_t)(p * (m_latencies_count - 1));
+  return m_latencies[idx] / 1000.0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//"3:50,16:20" -> weights of function codes
+static int
+mix_parse(const char *str) {
+  char *end;
+  unsigned long fc, w;
+  memset(m_cfg.mix, 0, sizeof(m_cfg.mix));
+  m_cfg.mix_total = 0;
+  while (*str) {
+    fc = strtoul(str, &end, 0);
+    if (*end != ':' || fc > 0xff) return -1;
+    w = strtoul(end + 1, &end, 0);
+    if (w > 0xffff || (*end && *end != ',')) return -1;
+    switch (fc) {
+      case mbfc_read_coils: case mbfc_read_discrete_input:
+      case mbfc_read_holding_registers: case mbfc_read_input_registers:
+      case mbfc_write_single_coil: case mbfc_write_single_register:
+      case mbfc_write_multiple_coils: case mbfc_write_multiple_registers:
+        break;
+      default:
+        return -1;
+    }
+    m_cfg.mix[fc] = (uint16_t)w;
+    m_cfg.mix_total += (uint32_t)w;
+    str = *end ? end + 1 : end;
+  }
+  return m_cfg.mix_total ? 0 : -1;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+usage(const char *name) {
+  fprintf(stderr, "usage : %s [-n slaves] [-b baud] [-e permille] [-d ms] [-r requests]\n"
+                  "          [-m mix] [-q quantity] [-t timeout_us] [-s seed]\n"
+                  "  -n  slaves (pty lines), default 4, max %u\n"
+                  "  -b  pace frames as on the wire at baud, default 0 - no pacing\n"
+                  "  -e  corrupt so many requests of 1000, default 0\n"
+                  "  -d  duration in ms, default 5000\n"
+                  "  -r  stop after so many requests\n"
+                  "  -m  fc:weight list, default 3:40,4:10,6:15,16:15,1:10,5:5,15:5\n"
+                  "  -q  max registers per request (bits are 8 times more), default 16\n"
+                  "  -t  response timeout, default 100000 us\n"
+                  "  -s  random seed\n", name, BUSIM_MAX_SLAVES);
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+main(int argc, char *argv[]) {
+  uint64_t t0, elapsed;
+  uint8_t i, agree = 1;
+  int opt;
+
+  m_cfg.slaves = 4;
+  m_cfg.duration_ms = 5000;
+  m_cfg.timeout_us = 100000;
+  m_cfg.max_quantity = 16;
+  mix_parse("3:40,4:10,6:15,16:15,1:10,5:5,15:5");
+
+  while ((opt = getopt(argc, argv, "n:b:e:d:r:m:q:t:s:")) != -1) {
+    switch (opt) {
+      case 'n': m_cfg.slaves = (uint8_t)atoi(optarg); break;
+      case 'b': m_cfg.baud = (uint32_t)atoi(optarg); break;
+      case 'e': m_cfg.err_permille = (uint32_t)atoi(optarg); break;
+      case 'd': m_cfg.duration_ms = (uint32_t)atoi(optarg); break;
+      case 'r': m_cfg.requests = (uint32_t)atoi(optarg); break;
+      case 'm':
+        if (mix_parse(optarg)) {
+          fprintf(stderr, "bad mix %s\n", optarg);
+          return 2;
+        }
+        break;
+      case 'q': m_cfg.max_quantity = (uint16_t)atoi(optarg); break;
+      case 't': m_cfg.timeout_us = (uint32_t)atoi(optarg); break;
+      case 's': m_rnd = strtoull(optarg, NULL, 0) | 1; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+
+  if (!m_cfg.slaves || m_cfg.slaves > BUSIM_MAX_SLAVES ||
+      !m_cfg.max_quantity || m_cfg.max_quantity > 0x7b) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  if (!(m_latencies = (uint32_t*)malloc(BUSIM_MAX_LATENCIES * sizeof(uint32_t))))
+    return 2;
+
+  for (i = 0; i < m_cfg.slaves; ++i) {
+    if (line_open(&m_lines[i], i + 1)) {
+      fprintf(stderr, "can't create pty for slave %u\n", i + 1);
+      while (i--) line_close(&m_lines[i]);
+      return 2;
+    }
+  }
+
+  t0 = now_ns();
+  load_run();
+  elapsed = now_ns() - t0;
+
+  for (i = 0; i < m_cfg.slaves; ++i)
+    agree = counters_check(&m_lines[i]) && agree;
+  for (i = 0; i < m_cfg.slaves; ++i)
+    line_close(&m_lines[i]);
+
+  qsort(m_latencies, m_latencies_count, sizeof(uint32_t), cmp_u32);
+  printf("transactions=%llu ok=%llu exceptions=%llu timeouts=%llu bad_responses=%llu "
+         "corrupted=%llu elapsed_ms=%llu tps=%.0f lat_p50_us=%.1f lat_p90_us=%.1f "
+         "lat_p99_us=%.1f lat_p999_us=%.1f lat_max_us=%.1f counters=%s\n",
+         (unsigned long long)m_stat.transactions, (unsigned long long)m_stat.ok,
+         (unsigned long long)m_stat.exceptions, (unsigned long long)m_stat.timeouts,
+         (unsigned long long)m_stat.bad_responses, (unsigned long long)m_stat.corrupted,
+         (unsigned long long)(elapsed / 1000000u),
+         elapsed ? m_stat.transactions * 1e9 / elapsed : 0.0,
+         percentile_us(0.5), percentile_us(0.9), percentile_us(0.99),
+         percentile_us(0.999), percentile_us(1.0), agree ? "agree" : "MISMATCH");
+  free(m_latencies);
+
+  return (!agree || m_stat.timeouts || m_stat.bad_responses || m_stat.exceptions) ? 1 : 0;
+}
@@ -2,16 +2,50 @@
 
 #include "commons.h"
 
+//"00".."99", two digits per division
+static const char digits2[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+//right to left from the end of buff, pairs of digits while there is room
+//for them. digits which don't fit are dropped from the left
+static char *
+digits_to_str(char *buff,
+              uint32_t val,
+              uint16_t buff_len) {
+  char* pbe;
+  char* end;
+  const char* d;
+  if (!buff_len) return buff;
+
+  end = pbe = &buff[buff_len-1];
+  *pbe = 0;
+  while (val >= 10 && pbe - buff >= 2) {
+    d = &digits2[(val % 100) * 2];
+    val /= 100;
+    *(--pbe) = d[1];
+    *(--pbe) = d[0];
+  }
+  if (pbe > buff && (val || pbe == end))
+    *(--pbe) = (char)(val % 10) + '0';
+  return pbe;
+}
+//////////////////////////////////////////////////////////////////////////
+
+char *
+uint32_to_str(char *buff,
+              uint32_t val,
+              uint16_t buff_len) {
+  return digits_to_str(buff, val, buff_len);
+}
+//////////////////////////////////////////////////////////////////////////
+
 char *
 uint16_to_str(char *buff,
               uint16_t val,
-              uint8_t buff_len) {
-  char* pbe = &buff[buff_len-1];
-  for (*pbe = 0; val && (pbe >= buff);) {
-    *(--pbe) = (val % 10) + '0';
-    val /= 10;
-  }
-  return pbe;
+              uint16_t buff_len) {
+  return digits_to_str(buff, val, buff_len);
 }
 //////////////////////////////////////////////////////////////////////////
 
@@ -19,13 +53,9 @@ char *
 int16_to_str(char *buff,
              int16_t val,
              uint16_t buff_len) {
-  char* pbe = &buff[buff_len-1];
-  buff_len = val > 0;
-  for (*pbe = 0; val && (pbe >= buff);) {
-    *(--pbe) = (val % 10) + '0';
-    val /= 10;
-  }
-  if (!buff_len && (pbe > buff))
+  char* pbe = digits_to_str(buff, val < 0 ? (uint32_t)(-(int32_t)val) : (uint32_t)val,
+                            buff_len);
+  if (val < 0 && pbe > buff)
     *(--pbe) = '-';
   return pbe;
 }
@@ -76,8 +106,14 @@ static uint8_t crc_tbl_LO[] = {
 
 uint16_t
 crc16(uint8_t* msg, uint16_t len) {
-  uint8_t res_HI = 0xFF ;
-  uint8_t res_LO = 0xFF ;
+  return crc16_continue(0xFFFF, msg, len);
+}
+////////////////////////////////////////////////////////////////////////////
+
+uint16_t
+crc16_continue(uint16_t crc, uint8_t* msg, uint16_t len) {
+  uint8_t res_HI = crc >> 8 ;
+  uint8_t res_LO = crc & 0xFF ;
   uint16_t index ; /* will index into CRC lookup table */
   while (len--)  {
     index = res_LO ^ (*msg++) ;
@@ -88,6 +124,28 @@ crc16(uint8_t* msg, uint16_t len) {
 }
 ////////////////////////////////////////////////////////////////////////////
 
+void
+crc16_x2(uint8_t* msg_a, uint16_t len_a, uint8_t* msg_b, uint16_t len_b,
+         uint16_t* crc_a, uint16_t* crc_b) {
+  uint8_t a_HI = 0xFF, a_LO = 0xFF ;
+  uint8_t b_HI = 0xFF, b_LO = 0xFF ;
+  uint16_t ia, ib ;
+  uint16_t common = len_a < len_b ? len_a : len_b ;
+  len_a -= common ;
+  len_b -= common ;
+  while (common--) {
+    ia = a_LO ^ (*msg_a++) ;
+    ib = b_LO ^ (*msg_b++) ;
+    a_LO = a_HI ^ crc_tbl_HI[ia] ;
+    b_LO = b_HI ^ crc_tbl_HI[ib] ;
+    a_HI = crc_tbl_LO[ia] ;
+    b_HI = crc_tbl_LO[ib] ;
+  }
+  *crc_a = crc16_continue(a_HI << 8 | a_LO, msg_a, len_a) ;
+  *crc_b = crc16_continue(b_HI << 8 | b_LO, msg_b, len_b) ;
+}
+////////////////////////////////////////////////////////////////////////////
+
 /*We */
 void
 print_binary(uint8_t val) {
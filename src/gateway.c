@@ -0,0 +1,644 @@
+#define _DEFAULT_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "commons.h"
+#include "modbus_common.h"
+#include "modbus_rtu_client.h"
+
+/*
+ * Modbus TCP to RTU gateway.
+ * Every bus (-d) serves range of unit ids and has bounded queue of
+ * transactions, one transaction is on the wire at a time.
+ * Identical read requests (fc 01-04, same unit and pdu) which are queued
+ * or on the wire at the same time are merged : bus is asked once and
+ * answer goes to every waiting client with its own transaction id.
+ * Next transaction is picked round robin by client, and one client can't
+ * hold more than GW_PER_CLIENT queue slots of a bus, so one aggressive
+ * poller can't starve others.
+ * Full queue is answered with mbec_server_device_busy, unknown unit with
+ * mbec_gateway_path_unavailable, bus timeout with
+ * mbec_gateway_target_device_failed_to_respond.
+ * Broadcast (unit 0) write holds the bus for turnaround delay (-b) and is
+ * answered then as a normal write response, other broadcast requests are
+ * answered with mbec_illegal_function.
+ */
+
+#define GW_MAX_BUSES 8
+#define GW_MAX_CLIENTS 32
+#define GW_QUEUE_LEN 16
+#define GW_PER_CLIENT 4
+#define GW_MAX_WAITERS 8
+#define GW_MBAP_LEN 7
+#define GW_MAX_PDU 253
+
+typedef struct gw_waiter {
+  uint8_t client;
+  uint32_t gen;         //client slot generation, answer is dropped if changed
+  uint16_t tid;         //mbap transaction id
+} gw_waiter_t;
+
+typedef struct gw_txn {
+  uint8_t used;
+  uint8_t owner;        //client which created transaction, for fairness
+  uint8_t unit;
+  uint8_t pdu_len;
+  uint8_t pdu[GW_MAX_PDU];
+  uint8_t waiters_count;
+  gw_waiter_t waiters[GW_MAX_WAITERS];
+} gw_txn_t;
+
+typedef struct gw_stat {
+  uint64_t requests;    //tcp requests for this bus
+  uint64_t transactions;//rtu transactions
+  uint64_t merged;      //requests answered by transaction of another request
+  uint64_t rejected;    //queue or client quota is full
+  uint64_t timeouts;
+  uint64_t crc_errors;
+} gw_stat_t;
+
+typedef struct gw_bus {
+  int fd;
+  uint32_t baud;
+  uint8_t first_unit;
+  uint8_t last_unit;
+  gw_txn_t queue[GW_QUEUE_LEN];
+  gw_txn_t* active;     //on the wire
+  uint8_t rr_next;      //client to be served first
+  uint8_t resp[mbaz_rs485];
+  uint16_t resp_len;
+  uint16_t resp_expected; //0 - unknown, frame ends with silence
+  uint64_t deadline_ns;   //response timeout
+  uint64_t silence_ns;    //end of frame if no more bytes till then
+  gw_stat_t stat;
+} gw_bus_t;
+
+typedef struct gw_client {
+  int fd;               //-1 - free slot
+  uint32_t gen;
+  uint8_t buff[GW_MBAP_LEN + GW_MAX_PDU];
+  uint16_t len;
+} gw_client_t;
+
+static gw_bus_t m_buses[GW_MAX_BUSES];
+static uint8_t m_buses_count = 0;
+static gw_client_t m_clients[GW_MAX_CLIENTS];
+static uint32_t m_timeout_ms = 500;
+static uint32_t m_turnaround_ms = 100; //after broadcast
+static volatile sig_atomic_t m_stop = 0;
+
+static inline uint64_t
+now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//3.5 characters, fixed 1750us above 19200 as specification says
+static inline uint64_t
+t35_ns(uint32_t baud) {
+  if (baud > 19200) return 1750000u;
+  return (uint64_t)35 * 11 * 1000000000u / 10 / baud;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static speed_t
+baud_to_speed(uint32_t baud) {
+  switch (baud) {
+    case 1200: return B1200;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    default: return B0;
+  }
+}
+//////////////////////////////////////////////////////////////////////////
+
+//path,baud,first_unit-last_unit
+static int
+bus_open(const char* arg) {
+  gw_bus_t* bus = &m_buses[m_buses_count];
+  char path[256];
+  unsigned baud, first, last;
+  struct termios tio;
+  speed_t speed;
+
+  if (m_buses_count == GW_MAX_BUSES ||
+      sscanf(arg, "%255[^,],%u,%u-%u", path, &baud, &first, &last) != 4 ||
+      (speed = baud_to_speed(baud)) == B0 || first > last || last > MB_MAX_ADDRESS)
+    return -1;
+
+  if ((bus->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0)
+    return -1;
+  if (!tcgetattr(bus->fd, &tio)) { //pty or file is fine for tests
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(bus->fd, TCSANOW, &tio);
+  }
+
+  bus->baud = baud;
+  bus->first_unit = (uint8_t)first;
+  bus->last_unit = (uint8_t)last;
+  ++m_buses_count;
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static gw_bus_t*
+bus_for_unit(uint8_t unit) {
+  uint8_t i;
+  for (i = 0; i < m_buses_count; ++i) {
+    if (unit >= m_buses[i].first_unit && unit <= m_buses[i].last_unit)
+      return &m_buses[i];
+  }
+  return NULL;
+}
+//////////////////////////////////////////////////////////////////////////
+
+/*tcp side*/
+
+static void
+client_close(uint8_t idx) {
+  close(m_clients[idx].fd);
+  m_clients[idx].fd = -1;
+  m_clients[idx].len = 0;
+  ++m_clients[idx].gen; //answers to closed connection are dropped
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+client_send(const gw_waiter_t* w, uint8_t unit, const uint8_t* pdu, uint16_t pdu_len) {
+  gw_client_t* c = &m_clients[w->client];
+  uint8_t frame[GW_MBAP_LEN + GW_MAX_PDU];
+
+  if (c->fd < 0 || c->gen != w->gen) return;
+  U16_MSB2Stream(w->tid, frame);
+  U16_MSB2Stream(0, frame + 2);
+  U16_MSB2Stream(pdu_len + 1, frame + 4);
+  frame[6] = unit;
+  memcpy(frame + GW_MBAP_LEN, pdu, pdu_len);
+  //responses are small, socket buffer full means client doesn't read
+  if (send(c->fd, frame, GW_MBAP_LEN + pdu_len, MSG_NOSIGNAL) !=
+      (ssize_t)(GW_MBAP_LEN + pdu_len))
+    client_close(w->client);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+client_send_exc(const gw_waiter_t* w, uint8_t unit, uint8_t fc, uint8_t code) {
+  uint8_t pdu[2] = {(uint8_t)(fc | 0x80), code};
+  client_send(w, unit, pdu, sizeof(pdu));
+}
+//////////////////////////////////////////////////////////////////////////
+
+/*bus queue*/
+
+static inline uint8_t
+is_mergeable(uint8_t fc) {
+  return fc == mbfc_read_coils || fc == mbfc_read_discrete_input ||
+      fc == mbfc_read_holding_registers || fc == mbfc_read_input_registers;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static inline uint8_t
+txn_same(const gw_txn_t* t, uint8_t unit, const uint8_t* pdu, uint8_t pdu_len) {
+  return t->used && t->unit == unit && t->pdu_len == pdu_len &&
+      t->waiters_count < GW_MAX_WAITERS && !memcmp(t->pdu, pdu, pdu_len);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static inline uint8_t
+is_broadcast_write(uint8_t fc) {
+  return fc == mbfc_write_single_coil || fc == mbfc_write_single_register ||
+      fc == mbfc_write_multiple_coils || fc == mbfc_write_multiple_registers ||
+      fc == mbfc_mask_write_registers;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+bus_request(gw_bus_t* bus, const gw_waiter_t* w, uint8_t unit,
+            const uint8_t* pdu, uint8_t pdu_len) {
+  gw_txn_t* t;
+  gw_txn_t* free_slot = NULL;
+  uint8_t i, owned = 0;
+
+  ++bus->stat.requests;
+  if (unit == MB_BROADCAST_ADDRESS && !is_broadcast_write(pdu[0])) {
+    client_send_exc(w, unit, pdu[0], mbec_illegal_function);
+    return;
+  }
+  if (is_mergeable(pdu[0])) {
+    if (bus->active && txn_same(bus->active, unit, pdu, pdu_len)) {
+      bus->active->waiters[bus->active->waiters_count++] = *w;
+      ++bus->stat.merged;
+      return;
+    }
+    for (i = 0; i < GW_QUEUE_LEN; ++i) {
+      t = &bus->queue[i];
+      if (t == bus->active || !txn_same(t, unit, pdu, pdu_len)) continue;
+      t->waiters[t->waiters_count++] = *w;
+      ++bus->stat.merged;
+      return;
+    }
+  }
+
+  for (i = 0; i < GW_QUEUE_LEN; ++i) {
+    t = &bus->queue[i];
+    if (!t->used) {
+      if (!free_slot) free_slot = t;
+    } else if (t != bus->active && t->owner == w->client) {
+      ++owned;
+    }
+  }
+
+  if (!free_slot || owned >= GW_PER_CLIENT) {
+    ++bus->stat.rejected;
+    client_send_exc(w, unit, pdu[0], mbec_server_device_busy);
+    return;
+  }
+
+  free_slot->used = 1;
+  free_slot->owner = w->client;
+  free_slot->unit = unit;
+  free_slot->pdu_len = pdu_len;
+  memcpy(free_slot->pdu, pdu, pdu_len);
+  free_slot->waiters[0] = *w;
+  free_slot->waiters_count = 1;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//round robin by owner, starting from rr_next
+static gw_txn_t*
+bus_pick(gw_bus_t* bus) {
+  uint8_t c, i, client;
+  for (c = 0; c < GW_MAX_CLIENTS; ++c) {
+    client = (uint8_t)((bus->rr_next + c) % GW_MAX_CLIENTS);
+    for (i = 0; i < GW_QUEUE_LEN; ++i) {
+      if (bus->queue[i].used && bus->queue[i].owner == client) {
+        bus->rr_next = (uint8_t)((client + 1) % GW_MAX_CLIENTS);
+        return &bus->queue[i];
+      }
+    }
+  }
+  return NULL;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//response length by request, 0 if it can't be known
+static uint16_t
+rtu_response_len(const uint8_t* pdu, uint8_t pdu_len) {
+  uint16_t q = pdu_len >= 5 ? U16_MSBFromStream((uint8_t*)pdu + 3) : 0;
+  switch (pdu[0]) {
+    case mbfc_read_coils:
+    case mbfc_read_discrete_input:
+      return 5 + nearestMultipleOf8(q) / 8;
+    case mbfc_read_holding_registers:
+    case mbfc_read_input_registers:
+      return 5 + q * 2;
+    case mbfc_write_single_coil:
+    case mbfc_write_single_register:
+    case mbfc_write_multiple_coils:
+    case mbfc_write_multiple_registers:
+      return 8;
+    case mbfc_mask_write_registers:
+      return 10;
+    case mbfc_read_write_multiple_registers:
+      return 5 + q * 2;
+    default:
+      return 0;
+  }
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+txn_done(gw_bus_t* bus, gw_txn_t* t) {
+  t->used = 0;
+  if (bus->active == t) bus->active = NULL;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+bus_start(gw_bus_t* bus, uint64_t now) {
+  uint8_t frame[mbaz_rs485];
+  uint16_t len;
+  gw_txn_t* t;
+  uint8_t i;
+
+  if (bus->active || !(t = bus_pick(bus))) return;
+
+  frame[0] = t->unit;
+  memcpy(frame + 1, t->pdu, t->pdu_len);
+  len = 1 + t->pdu_len;
+  U16_LSB2Stream(crc16(frame, len), frame + len);
+  len += 2;
+
+  tcflush(bus->fd, TCIFLUSH); //late garbage of previous transaction
+  if (write(bus->fd, frame, len) != len) {
+    for (i = 0; i < t->waiters_count; ++i)
+      client_send_exc(&t->waiters[i], t->unit, t->pdu[0], mbec_gateway_path_unavailable);
+    txn_done(bus, t);
+    return;
+  }
+
+  ++bus->stat.transactions;
+  bus->active = t;
+  bus->resp_len = 0;
+  bus->resp_expected = rtu_response_len(t->pdu, t->pdu_len);
+  //wire time of request is added to timeout. nobody answers broadcast,
+  //bus is held for turnaround delay and deadline completes it
+  bus->deadline_ns = now + (uint64_t)len * 11u * 1000000000u / bus->baud +
+      (uint64_t)(t->unit == MB_BROADCAST_ADDRESS ? m_turnaround_ms : m_timeout_ms) *
+      1000000u;
+  bus->silence_ns = 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+bus_finish(gw_bus_t* bus) {
+  gw_txn_t* t = bus->active;
+  uint8_t* r = bus->resp;
+  uint16_t len = bus->resp_len;
+  uint8_t i, valid;
+
+  valid = len >= 5 && r[0] == t->unit && (r[1] & 0x7f) == t->pdu[0] &&
+      U16_LSBFromStream(r + len - 2) == crc16(r, len - 2);
+  if (!valid) ++bus->stat.crc_errors;
+
+  for (i = 0; i < t->waiters_count; ++i) {
+    if (valid)
+      client_send(&t->waiters[i], t->unit, r + 1, len - 3);
+    else
+      client_send_exc(&t->waiters[i], t->unit, t->pdu[0],
+                      mbec_gateway_target_device_failed_to_respond);
+  }
+  txn_done(bus, t);
+}
+//////////////////////////////////////////////////////////////////////////
+
+//slaves executed broadcast write silently, answer is what one of them
+//would send : echo of request or its address and quantity
+static void
+bus_broadcast_done(gw_bus_t* bus) {
+  gw_txn_t* t = bus->active;
+  uint8_t i, len = t->pdu_len;
+  if (t->pdu[0] == mbfc_write_multiple_coils || t->pdu[0] == mbfc_write_multiple_registers)
+    len = 5;
+  for (i = 0; i < t->waiters_count; ++i)
+    client_send(&t->waiters[i], t->unit, t->pdu, len);
+  txn_done(bus, t);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+bus_timeout(gw_bus_t* bus) {
+  gw_txn_t* t = bus->active;
+  uint8_t i;
+  if (t->unit == MB_BROADCAST_ADDRESS) {
+    bus_broadcast_done(bus);
+    return;
+  }
+  ++bus->stat.timeouts;
+  for (i = 0; i < t->waiters_count; ++i)
+    client_send_exc(&t->waiters[i], t->unit, t->pdu[0],
+                    mbec_gateway_target_device_failed_to_respond);
+  txn_done(bus, t);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+bus_read(gw_bus_t* bus, uint64_t now) {
+  ssize_t n = read(bus->fd, bus->resp + bus->resp_len, sizeof(bus->resp) - bus->resp_len);
+  if (n <= 0 || !bus->active || bus->active->unit == MB_BROADCAST_ADDRESS) return;
+  bus->resp_len += (uint16_t)n;
+  bus->silence_ns = now + t35_ns(bus->baud);
+  if ((bus->resp_len >= 2 && (bus->resp[1] & 0x80) && bus->resp_len >= 5) ||
+      (bus->resp_expected && bus->resp_len >= bus->resp_expected) ||
+      bus->resp_len == sizeof(bus->resp))
+    bus_finish(bus);
+}
+//////////////////////////////////////////////////////////////////////////
+
+//frames of one client, there may be several in one read
+static void
+client_read(uint8_t idx) {
+  gw_client_t* c = &m_clients[idx];
+  gw_waiter_t w;
+  gw_bus_t* bus;
+  uint16_t flen, mbap_len;
+  ssize_t n;
+
+  n = read(c->fd, c->buff + c->len, sizeof(c->buff) - c->len);
+  if (n <= 0) {
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return;
+    client_close(idx);
+    return;
+  }
+  c->len += (uint16_t)n;
+
+  while (c->len >= GW_MBAP_LEN) {
+    mbap_len = U16_MSBFromStream(c->buff + 4);
+    if (U16_MSBFromStream(c->buff + 2) != 0 || mbap_len < 2 ||
+        mbap_len > GW_MAX_PDU + 1) {
+      client_close(idx); //not modbus, resync is impossible
+      return;
+    }
+    flen = 6 + mbap_len;
+    if (c->len < flen) return;
+
+    w.client = idx;
+    w.gen = c->gen;
+    w.tid = U16_MSBFromStream(c->buff);
+    if (!(bus = bus_for_unit(c->buff[6])))
+      client_send_exc(&w, c->buff[6], c->buff[7], mbec_gateway_path_unavailable);
+    else
+      bus_request(bus, &w, c->buff[6], c->buff + GW_MBAP_LEN, (uint8_t)(mbap_len - 1));
+
+    if (c->fd < 0) return; //closed while answering
+    memmove(c->buff, c->buff + flen, c->len - flen);
+    c->len -= flen;
+  }
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+client_accept(int lfd) {
+  uint8_t i;
+  int fd, one = 1;
+  if ((fd = accept(lfd, NULL, NULL)) < 0) return;
+  for (i = 0; i < GW_MAX_CLIENTS && m_clients[i].fd >= 0; ++i)
+    ;
+  if (i == GW_MAX_CLIENTS) {
+    close(fd);
+    return;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  m_clients[i].fd = fd;
+  m_clients[i].len = 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+listen_on(uint16_t port) {
+  struct sockaddr_in addr;
+  int fd, one = 1;
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 16)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+on_signal(int sig) {
+  UNUSED_ARG(sig);
+  m_stop = 1;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+print_stat() {
+  uint8_t i;
+  for (i = 0; i < m_buses_count; ++i) {
+    gw_stat_t* s = &m_buses[i].stat;
+    printf("bus=%u units=%u-%u requests=%llu transactions=%llu merged=%llu "
+           "rejected=%llu timeouts=%llu crc_errors=%llu\n", i,
+           m_buses[i].first_unit, m_buses[i].last_unit,
+           (unsigned long long)s->requests, (unsigned long long)s->transactions,
+           (unsigned long long)s->merged, (unsigned long long)s->rejected,
+           (unsigned long long)s->timeouts, (unsigned long long)s->crc_errors);
+  }
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+usage(const char* name) {
+  fprintf(stderr, "usage : %s [-p port] [-t timeout_ms] [-b turnaround_ms] "
+                  "-d path,baud,first-last [-d ...]\n"
+                  "  -p  tcp port, default 502\n"
+                  "  -t  bus response timeout, default 500 ms\n"
+                  "  -b  bus idle time after broadcast, default 100 ms\n"
+                  "  -d  serial bus and unit ids it serves, up to %u buses\n",
+          name, GW_MAX_BUSES);
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+main(int argc, char* argv[]) {
+  struct pollfd pfd[1 + GW_MAX_BUSES + GW_MAX_CLIENTS];
+  uint8_t client_of[GW_MAX_CLIENTS];
+  uint16_t port = 502;
+  uint64_t now, next;
+  int lfd, opt, timeout_ms;
+  uint8_t i, n, nc;
+
+  while ((opt = getopt(argc, argv, "p:t:b:d:")) != -1) {
+    switch (opt) {
+      case 'p': port = (uint16_t)atoi(optarg); break;
+      case 't': m_timeout_ms = (uint32_t)atoi(optarg); break;
+      case 'b': m_turnaround_ms = (uint32_t)atoi(optarg); break;
+      case 'd':
+        if (bus_open(optarg)) {
+          fprintf(stderr, "can't open bus %s\n", optarg);
+          return 2;
+        }
+        break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+
+  if (!m_buses_count) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  if ((lfd = listen_on(port)) < 0) {
+    fprintf(stderr, "can't listen on port %u\n", port);
+    return 2;
+  }
+
+  for (i = 0; i < GW_MAX_CLIENTS; ++i)
+    m_clients[i].fd = -1;
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  while (!m_stop) {
+    now = now_ns();
+    next = UINT64_MAX;
+    pfd[0].fd = lfd;
+    pfd[0].events = POLLIN;
+    for (i = 0; i < m_buses_count; ++i) {
+      gw_bus_t* bus = &m_buses[i];
+      bus_start(bus, now);
+      pfd[1 + i].fd = bus->fd;
+      pfd[1 + i].events = POLLIN;
+      if (!bus->active) continue;
+      if (bus->deadline_ns < next) next = bus->deadline_ns;
+      if (bus->silence_ns && bus->silence_ns < next) next = bus->silence_ns;
+    }
+    n = 1 + m_buses_count;
+    for (i = 0, nc = 0; i < GW_MAX_CLIENTS; ++i) {
+      if (m_clients[i].fd < 0) continue;
+      pfd[n + nc].fd = m_clients[i].fd;
+      pfd[n + nc].events = POLLIN;
+      client_of[nc++] = i;
+    }
+
+    timeout_ms = next == UINT64_MAX ? -1 :
+        next <= now ? 0 : (int)((next - now + 999999u) / 1000000u);
+    if (poll(pfd, n + nc, timeout_ms) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    now = now_ns();
+    for (i = 0; i < m_buses_count; ++i) {
+      gw_bus_t* bus = &m_buses[i];
+      if (pfd[1 + i].revents & POLLIN) bus_read(bus, now);
+      if (!bus->active) continue;
+      if (bus->silence_ns && now >= bus->silence_ns) bus_finish(bus); //frame by silence
+      else if (now >= bus->deadline_ns) bus_timeout(bus);
+    }
+    for (i = 0; i < nc; ++i) {
+      if (pfd[n + i].revents & (POLLIN | POLLHUP | POLLERR))
+        client_read(client_of[i]);
+    }
+    if (pfd[0].revents & POLLIN)
+      client_accept(lfd);
+  }
+
+  print_stat();
+  for (i = 0; i < GW_MAX_CLIENTS; ++i) {
+    if (m_clients[i].fd >= 0) close(m_clients[i].fd);
+  }
+  for (i = 0; i < m_buses_count; ++i)
+    close(m_buses[i].fd);
+  close(lfd);
+  return 0;
+}
@@ -1,73 +1,308 @@
+#include <stddef.h>
+
 #include "heap_memory.h"
 
-typedef struct mem_tag {
-  memory_t bit_and_size;
-} mem_tag_t;
+#if HM_TAG_BITS == 16
+typedef uint16_t mem_tag_t;
+#elif HM_TAG_BITS == 32
+typedef uint32_t mem_tag_t;
+#elif HM_TAG_BITS == 64
+typedef uint64_t mem_tag_t;
+#else
+#error "HM_TAG_BITS should be 16, 32 or 64"
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+
+#define TAG_SIZE sizeof(mem_tag_t)
+#define mem_block_allocate_bit ((mem_tag_t)1 << (HM_TAG_BITS - 1))
+#define is_block_allocated(x) ((x) & mem_block_allocate_bit)
+#define mem_tag_size(x) ((x) & ~mem_block_allocate_bit)
+#define mem_tag(p) (*(mem_tag_t*)(p))
+#define tag_align(x) (((x) + (TAG_SIZE - 1)) & ~(memory_t)(TAG_SIZE - 1))
+
+#if HM_HEAP_SIZE >= (1ULL << (HM_TAG_BITS - 1))
+#error "HM_HEAP_SIZE doesn't fit HM_TAG_BITS"
+#endif
+
+static uint8_t g_heap[HM_HEAP_SIZE]
+    __attribute__((section(".heap_memory"), aligned(8))) = {0};
+static hm_arena_t g_default_arena = {g_heap, g_heap, 0, 0};
+
+//arenas are only added, hm_free looks for owner of block here
+static hm_arena_t* g_arenas[HM_MAX_ARENAS] = {&g_default_arena};
+static uint8_t g_arenas_count = 1;
+
+#if HM_THREAD_SAFE
+static __thread hm_arena_t* t_arena = NULL;
+
+static inline void
+arena_lock(hm_arena_t* a) {
+  while (__atomic_test_and_set(&a->lock, __ATOMIC_ACQUIRE))
+    while (__atomic_load_n(&a->lock, __ATOMIC_RELAXED))
+      ;
+}
+
+static inline void
+arena_unlock(hm_arena_t* a) {
+  __atomic_clear(&a->lock, __ATOMIC_RELEASE);
+}
+#else
+static hm_arena_t* t_arena = NULL;
+#define arena_lock(a) ((void)(a))
+#define arena_unlock(a) ((void)(a))
+#endif
+//////////////////////////////////////////////////////////////////////////
+
+/*fixed size pools. bit is set in map for every taken block*/
+typedef struct hm_slab {
+  uint8_t* mem;
+  uint32_t* map;
+  uint16_t size;
+  uint16_t count;
+} hm_slab_t;
 
+#define slab_words(count) (((count) + 31) / 32)
+#define slab_array_len(count) ((count) ? (count) : 1)
+
+static uint8_t g_slab_small[slab_array_len(HM_SLAB_SMALL_COUNT)][HM_SLAB_SMALL_SIZE]
+    __attribute__((aligned(8)));
+static uint32_t g_slab_small_map[slab_array_len(slab_words(HM_SLAB_SMALL_COUNT))];
+static uint8_t g_slab_adu[slab_array_len(HM_SLAB_ADU_COUNT)][HM_SLAB_ADU_SIZE]
+    __attribute__((aligned(8)));
+static uint32_t g_slab_adu_map[slab_array_len(slab_words(HM_SLAB_ADU_COUNT))];
+
+static hm_slab_t g_slabs[] = {
+  {&g_slab_small[0][0], g_slab_small_map, HM_SLAB_SMALL_SIZE, HM_SLAB_SMALL_COUNT},
+  {&g_slab_adu[0][0], g_slab_adu_map, HM_SLAB_ADU_SIZE, HM_SLAB_ADU_COUNT},
+};
+#define SLABS_COUNT (sizeof(g_slabs) / sizeof(g_slabs[0]))
+
+static memory_t
+slab_alloc(hm_slab_t* sl) {
+  uint16_t w, bit;
+  uint32_t v;
+  for (w = 0; w < slab_words(sl->count); ++w) {
+#if HM_THREAD_SAFE
+    v = __atomic_load_n(&sl->map[w], __ATOMIC_RELAXED);
+    while (~v) {
+      bit = (uint16_t)__builtin_ctz(~v);
+      if (w * 32u + bit >= sl->count) break;
+      if (__atomic_compare_exchange_n(&sl->map[w], &v, v | (1u << bit), 1,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return (memory_t)(sl->mem + (w * 32u + bit) * sl->size);
+    }
+#else
+    v = sl->map[w];
+    if (!~v) continue;
+    bit = (uint16_t)__builtin_ctz(~v);
+    if (w * 32u + bit >= sl->count) break;
+    sl->map[w] = v | (1u << bit);
+    return (memory_t)(sl->mem + (w * 32u + bit) * sl->size);
+#endif
+  }
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//returns 0 if p isn't from pools
+static uint8_t
+slab_free(memory_t p) {
+  uint8_t i;
+  uint32_t idx;
+  for (i = 0; i < SLABS_COUNT; ++i) {
+    if (p < (memory_t)g_slabs[i].mem ||
+        p >= (memory_t)g_slabs[i].mem + (memory_t)g_slabs[i].size * g_slabs[i].count)
+      continue;
+    idx = (uint32_t)((p - (memory_t)g_slabs[i].mem) / g_slabs[i].size);
+#if HM_THREAD_SAFE
+    __atomic_fetch_and(&g_slabs[i].map[idx / 32], ~(1u << idx % 32), __ATOMIC_RELEASE);
+#else
+    g_slabs[i].map[idx / 32] &= ~(1u << idx % 32);
+#endif
+    return 1;
+  }
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+uint16_t
+hm_slab_used(uint8_t idx) {
+  uint16_t w, n = 0;
+  if (idx >= SLABS_COUNT) return 0;
+  for (w = 0; w < slab_words(g_slabs[idx].count); ++w)
+    n += (uint16_t)__builtin_popcount(g_slabs[idx].map[w]);
+  return n;
+}
 //////////////////////////////////////////////////////////////////////////
 
-#define HEAP_SIZE 2048
-#define mem_block_allocate_bit 0x8000000000000000U
-#define is_block_allocated(x) ((x & mem_block_allocate_bit))
+int
+hm_arena_init(hm_arena_t* a, void* mem, memory_t size) {
+  uint8_t i, n;
+  memory_t begin = tag_align((memory_t)mem);
+  memory_t end = ((memory_t)mem + size) & ~(memory_t)(TAG_SIZE - 1);
 
-#define mem_tag_size(x) ((x & ~mem_block_allocate_bit))
-#define mem_block_allocate(mem_block, size) (mem_block)=(size)|mem_block_allocate_bit
-#define mem_tag_free(mem_block) (mem_block &= ~mem_block_allocate_bit )
+  if (end <= begin + TAG_SIZE || end - begin > mem_block_allocate_bit)
+    return -1;
 
-static uint8_t g_heap[HEAP_SIZE] __attribute__((section(".heap_memory"))) = {0};
-static uint8_t* g_heap_end = g_heap + HEAP_SIZE;
+  //hm_free reads begin and end without lock, so they are set before
+  //arena is published
+  a->begin = (uint8_t*)begin;
+  a->end = (uint8_t*)end;
+  a->alloc_failures = 0;
+  a->lock = 0;
+  mem_tag(a->begin) = (mem_tag_t)(end - begin - TAG_SIZE);
+
+#if HM_THREAD_SAFE
+  n = __atomic_load_n(&g_arenas_count, __ATOMIC_ACQUIRE);
+  for (i = 0; i < n && __atomic_load_n(&g_arenas[i], __ATOMIC_ACQUIRE) != a; ++i)
+    ;
+  if (i < n)
+    return 0;
+  //threads creating arenas at once claim different slots
+  do {
+    if (n == HM_MAX_ARENAS)
+      return -1;
+  } while (!__atomic_compare_exchange_n(&g_arenas_count, &n, n + 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  __atomic_store_n(&g_arenas[n], a, __ATOMIC_RELEASE);
+#else
+  n = g_arenas_count;
+  for (i = 0; i < n && g_arenas[i] != a; ++i)
+    ;
+  if (i < n)
+    return 0;
+  if (n == HM_MAX_ARENAS)
+    return -1;
+  g_arenas[n] = a;
+  g_arenas_count = n + 1;
+#endif
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
 
 void
 hm_init() {
-  mem_tag_t* mt = (mem_tag_t*)g_heap;  
-  mt->bit_and_size = g_heap_end - sizeof(mem_tag_t) - g_heap;
+  uint8_t i;
+  uint16_t w;
+  for (i = 0; i < SLABS_COUNT; ++i)
+    for (w = 0; w < slab_words(g_slabs[i].count); ++w)
+      g_slabs[i].map[w] = 0;
+  hm_arena_init(&g_default_arena, g_heap, HM_HEAP_SIZE);
 }
 //////////////////////////////////////////////////////////////////////////
 
-memory_t hm_malloc(memory_t size) {
-  mem_tag_t* rv = (mem_tag_t*)g_heap;
-  size = (size + 1) & (~0x01); //if (size % 2) ++size; we will operate with even addresses.
-  for(;;) {
-    if (!is_block_allocated(rv->bit_and_size) && (rv->bit_and_size > size)) {
-      if (rv->bit_and_size > (size + sizeof(mem_tag_t))) {
-        ((mem_tag_t*)((memory_t)rv + size + sizeof(mem_tag_t)))->bit_and_size =
-            rv->bit_and_size - (size + sizeof(mem_tag_t));
-      } else {
-        size = rv->bit_and_size; //if we at the end of memory
-      }
-      mem_block_allocate(rv->bit_and_size, size); //mark block allocated.
-      return (memory_t)rv + sizeof(mem_tag_t);
-    }
+void
+hm_arena_use(hm_arena_t* a) {
+  t_arena = a;
+}
+//////////////////////////////////////////////////////////////////////////
 
-    *(memory_t*)&rv = (memory_t)rv + mem_tag_size(rv->bit_and_size) + sizeof(mem_tag_t); //change rv pointer.
-    if (((memory_t)rv & ~mem_block_allocate_bit) >= (memory_t)g_heap_end)
-      return 0; //we haven't enough memory
+memory_t
+hm_arena_malloc(hm_arena_t* a, memory_t size) {
+  uint8_t* p;
+  mem_tag_t t;
+  size = size ? tag_align(size) : TAG_SIZE; //tags stay aligned
+
+  arena_lock(a);
+  for (p = a->begin; p < a->end; p += TAG_SIZE + mem_tag_size(t)) {
+    t = mem_tag(p);
+    if (is_block_allocated(t) || t < size)
+      continue;
+    if (t > size + TAG_SIZE) {
+      mem_tag(p + TAG_SIZE + size) = (mem_tag_t)(t - size - TAG_SIZE);
+    } else {
+      size = t; //rest is too small to be a block
+    }
+    mem_tag(p) = (mem_tag_t)size | mem_block_allocate_bit;
+    arena_unlock(a);
+    return (memory_t)(p + TAG_SIZE);
   }
+  ++a->alloc_failures; //we haven't enough memory
+  arena_unlock(a);
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+memory_t
+hm_malloc(memory_t size) {
+  memory_t p;
+  uint8_t i;
+  for (i = 0; i < SLABS_COUNT; ++i) //full pool - try next one, arena is the last
+    if (size <= g_slabs[i].size && (p = slab_alloc(&g_slabs[i])))
+      return p;
+  return hm_arena_malloc(t_arena ? t_arena : &g_default_arena, size);
 }
 //////////////////////////////////////////////////////////////////////////
 
 //if addr is not valid then behavior will be unpredictable
 void
-hm_free(memory_t p) {
-  mem_tag_t* next = (mem_tag_t*) (p - sizeof(mem_tag_t));
-  mem_tag_free(next->bit_and_size);
-  p = (memory_t)g_heap;
-  for (;;) {
-    next = (mem_tag_t*) (p + mem_tag_size(((mem_tag_t*)p)->bit_and_size) + sizeof(mem_tag_t));
-
-    if (!is_block_allocated(((mem_tag_t*)p)->bit_and_size)) {
-      if ((uint64_t)next >= (memory_t)g_heap_end) break;
-
-      if (!is_block_allocated(next->bit_and_size)) {
-        ((mem_tag_t*)p)->bit_and_size += next->bit_and_size + sizeof(mem_tag_t);
-      } else {
-        p = (memory_t)next;
-      }
-    } else {
-      p = (memory_t)next;
+hm_free(memory_t addr) {
+  hm_arena_t* a = NULL;
+  uint8_t *p, *next;
+  uint8_t i, n;
+
+  if (slab_free(addr))
+    return;
+#if HM_THREAD_SAFE
+  n = __atomic_load_n(&g_arenas_count, __ATOMIC_ACQUIRE);
+#else
+  n = g_arenas_count;
+#endif
+  for (i = 0; i < n; ++i) {
+#if HM_THREAD_SAFE
+    a = __atomic_load_n(&g_arenas[i], __ATOMIC_ACQUIRE);
+    if (!a) continue; //slot is claimed, arena isn't published yet
+#else
+    a = g_arenas[i];
+#endif
+    if (addr >= (memory_t)a->begin && addr < (memory_t)a->end)
+      break;
+  }
+  if (i == n) return;
+
+  arena_lock(a);
+  mem_tag((uint8_t*)addr - TAG_SIZE) &= ~mem_block_allocate_bit;
+  //merge neighbour free blocks
+  for (p = a->begin; p < a->end; p = next) {
+    next = p + TAG_SIZE + mem_tag_size(mem_tag(p));
+    if (is_block_allocated(mem_tag(p)))
+      continue;
+    while (next < a->end && !is_block_allocated(mem_tag(next))) {
+      mem_tag(p) += mem_tag(next) + TAG_SIZE;
+      next = p + TAG_SIZE + mem_tag(p);
     }
+  }
+  arena_unlock(a);
+}
+//////////////////////////////////////////////////////////////////////////
 
-    if (p >= (memory_t)g_heap_end) return;
+void
+hm_arena_stat(hm_arena_t* a, hm_stat_t* st) {
+  uint8_t* p;
+  memory_t size;
+  arena_lock(a);
+  st->size = (memory_t)(a->end - a->begin);
+  st->used = st->free = st->largest_free = 0;
+  st->blocks_used = st->blocks_free = 0;
+  st->alloc_failures = a->alloc_failures;
+  for (p = a->begin; p < a->end; p += size + TAG_SIZE) {
+    size = mem_tag_size(mem_tag(p));
+    if (is_block_allocated(mem_tag(p))) {
+      st->used += size;
+      ++st->blocks_used;
+    } else {
+      st->free += size;
+      ++st->blocks_free;
+      if (size > st->largest_free) st->largest_free = size;
+    }
   }
+  arena_unlock(a);
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+hm_stat(hm_stat_t* st) {
+  hm_arena_stat(&g_default_arena, st);
 }
 //////////////////////////////////////////////////////////////////////////
@@ -36,16 +36,31 @@ void mb_test_client() {
   dev.input_discrete_map.start_addr = 0;  // r bits
   dev.input_discrete_map.end_addr = sizeof(input_discrete_real);
   dev.input_discrete_map.real_addr = input_discrete_real;
+  dev.input_discrete_map.flags = mbbf_plain;
+  dev.input_discrete_map.seqlock = NULL;
   dev.coils_map.start_addr = 0;  // rw bits
   dev.coils_map.end_addr = sizeof(coils_real);
   dev.coils_map.real_addr = coils_real;
+  dev.coils_map.flags = mbbf_plain;
+  dev.coils_map.seqlock = NULL;
   dev.input_registers_map.start_addr = 0;  // r registers
   dev.input_registers_map.end_addr = sizeof(input_registers_real);
   dev.input_registers_map.real_addr = input_registers_real;
+  dev.input_registers_map.flags = mbrf_host_order;
+  dev.input_registers_map.seqlock = NULL;
   dev.holding_registers_map.start_addr = 0;  // rw registers
   dev.holding_registers_map.end_addr = sizeof(holding_registers_real);
   dev.holding_registers_map.real_addr = holding_registers_real;
+  dev.holding_registers_map.flags = mbrf_host_order;
+  dev.holding_registers_map.seqlock = NULL;
   dev.tp_send = send_stub;
+  dev.tp_sendv = NULL;
+  dev.tp_send_async = NULL;
+  dev.pf_before_execute = NULL;
+  dev.turnaround_ms = 0;
+  dev.pf_after_write = NULL;
+  dev.pf_check_write = NULL;
+  dev.ctx = NULL;
 
   uint8_t read_coils_arr[] = {
     0x04, 0x01, 0x00, 0x0a,
@@ -90,35 +105,61 @@ void mb_test_client() {
     0x11, 0x06, 0x00, 0x01, 0x00, 0x03, 0x9a, 0x9b
   };
 
+  //table ends right after the last requested bit, read must not go past it
+  uint8_t read_coils_table_end_arr[] = {
+    0x05, 0x01, 0x00, 0x01,
+    0x00, 0x07, 0x2d, 0x8c
+  };
+
+  uint8_t read_coils_past_table_end_arr[] = {
+    0x05, 0x01, 0x00, 0x01,
+    0x00, 0x08, 0x6d, 0x88
+  };
+
+  //same maps answer for addresses 1, 4 and 0x11
+  mb_client_device_t dev4 = dev;
+  mb_client_device_t dev17 = dev;
+  dev4.address = 4;
+  dev17.address = 0x11;
+
+  //address 5 has one byte of coils
+  uint8_t short_coils_real[1] = { 0x55 };
+  mb_client_device_t dev5 = dev;
+  dev5.address = 5;
+  dev5.coils_map.end_addr = sizeof(short_coils_real);
+  dev5.coils_map.real_addr = short_coils_real;
+
   hm_init();
   mb_init(&dev);
+  mb_add_device(&dev4);
+  mb_add_device(&dev17);
+  mb_add_device(&dev5);
 
-  dev.address = 4;
   printf("read coils : ");
   mb_handle_request(read_coils_arr, sizeof(read_coils_arr));
   printf("read input discrete : ");
   mb_handle_request(read_input_discrete_arr, sizeof(read_input_discrete_arr));
 
-  dev.address = 1;
   printf("read holding registers : ");
   mb_handle_request(read_holding_registers_arr, sizeof(read_holding_registers_arr));
   printf("read input registers : ");
   mb_handle_request(read_input_registers_arr, sizeof(read_input_registers_arr));
-  dev.address = 0x11;
   printf("write single coil : ");
   mb_handle_request(write_single_coil_arr, sizeof(write_single_coil_arr));
 
-  dev.address = 4;
   printf("write multiple coils : ");
   mb_handle_request(write_multiple_coils_arr, sizeof(write_multiple_coils_arr));
 
-  dev.address = 0x11;
   printf("write multiple registers : ");
   mb_handle_request(write_multiple_registers_arr, sizeof(write_multiple_registers_arr));
   printf("request device id : ");
   mb_handle_request(request_device_id_arr, sizeof(request_device_id_arr));
   printf("write single register : ");
   mb_handle_request(write_single_register_arr, sizeof(write_single_register_arr));
+  printf("read coils to table end : ");
+  mb_handle_request(read_coils_table_end_arr, sizeof(read_coils_table_end_arr));
+  printf("read coils past table end : ");
+  mb_handle_request(read_coils_past_table_end_arr, sizeof(read_coils_past_table_end_arr));
 }
 //////////////////////////////////////////////////////////////////////////
 
@@ -0,0 +1,105 @@
+#include <string.h>
+
+#include "mb_coils.h"
+
+#if defined(__AVR__)
+#define is_atomic(map) 0 //single core, nothing to race with but interrupts
+#else
+#define is_atomic(map) ((map)->flags & mbbf_atomic)
+#endif
+
+//request bits are LSB first, table bits are MSB first
+static inline uint8_t
+rev8(uint8_t b) {
+  b = (uint8_t)((b & 0xf0) >> 4 | (b & 0x0f) << 4);
+  b = (uint8_t)((b & 0xcc) >> 2 | (b & 0x33) << 2);
+  return (uint8_t)((b & 0xaa) >> 1 | (b & 0x55) << 1);
+}
+//////////////////////////////////////////////////////////////////////////
+
+#if !defined(__AVR__)
+//val and mask are bytes of word in memory order, so no endianness here
+static inline void
+word_update(uint8_t* word, const uint8_t* val, const uint8_t* mask) {
+  uint64_t* w = (uint64_t*)word;
+  uint64_t v, m, old, nv;
+  memcpy(&v, val, sizeof(v));
+  memcpy(&m, mask, sizeof(m));
+  v &= m;
+  old = __atomic_load_n(w, __ATOMIC_RELAXED);
+  do {
+    nv = (old & ~m) | v;
+  } while (!__atomic_compare_exchange_n(w, &old, nv, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+#endif
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_coils_write(mb_dev_bit_mapping_t* map, uint16_t address,
+               const uint8_t* bits, uint16_t quantity) {
+  uint8_t* p = map->real_addr;
+  uint16_t b = address / 8;
+  uint8_t shift = address % 8;
+  uint32_t end = (uint32_t)shift + quantity; //in bits from MSB of p[b]
+  uint16_t n = (uint16_t)((end + 7) / 8);   //table bytes to change
+  uint16_t req_bytes = (uint16_t)((quantity + 7) / 8);
+  uint8_t prev = 0, cur, v, m;
+  uint8_t wv[8], wm[8];
+  uint16_t j, k;
+
+  memset(wm, 0, sizeof(wm));
+  for (j = 0; j < n; ++j, ++b) {
+    cur = j < req_bytes ? rev8(bits[j]) : 0;
+    v = shift ? (uint8_t)((prev << (8 - shift)) | (cur >> shift)) : cur;
+    prev = cur;
+    m = 0xff;
+    if (!j) m >>= shift;
+    if (j == n - 1 && (end & 7)) m &= (uint8_t)(0xff << (8 - (end & 7)));
+
+    if (!is_atomic(map)) {
+      p[b] = (uint8_t)((p[b] & ~m) | (v & m));
+      continue;
+    }
+#if !defined(__AVR__)
+    k = b & 7;
+    wv[k] = v;
+    wm[k] = m;
+    if (k == 7 || j == n - 1) {
+      word_update(p + (b & ~7u), wv, wm);
+      memset(wm, 0, sizeof(wm));
+    }
+#else
+    (void)k; (void)wv;
+#endif
+  }
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_coil_write(mb_dev_bit_mapping_t* map, uint16_t address, uint8_t on) {
+  uint8_t* p = &map->real_addr[address / 8];
+  uint8_t m = 0x80 >> address % 8;
+#if !defined(__AVR__)
+  uint8_t mb[8] = {0};
+  uint64_t mask;
+  if (is_atomic(map)) {
+    mb[(address / 8) & 7] = m;
+    memcpy(&mask, mb, sizeof(mask));
+    if (on) __atomic_fetch_or((uint64_t*)(p - ((address / 8) & 7)), mask, __ATOMIC_RELEASE);
+    else __atomic_fetch_and((uint64_t*)(p - ((address / 8) & 7)), ~mask, __ATOMIC_RELEASE);
+    return;
+  }
+#endif
+  if (on) *p |= m;
+  else *p &= (uint8_t)~m;
+}
+//////////////////////////////////////////////////////////////////////////
+
+uint8_t
+mb_coil_read(const mb_dev_bit_mapping_t* map, uint16_t address) {
+  const uint8_t* p = &map->real_addr[address / 8];
+  uint8_t v = is_atomic(map) ? __atomic_load_n(p, __ATOMIC_RELAXED) : *p;
+  return (v & (0x80 >> address % 8)) ? 1 : 0;
+}
+//////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,190 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mb_image.h"
+
+static inline const mb_image_range_t*
+image_ranges(const mb_image_t* img, const mb_image_device_t* d) {
+  return (const mb_image_range_t*)((const uint8_t*)img->hdr + d->ro_offset);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+table_valid(const mb_image_table_t* t, uint8_t idx, uint32_t total_size) {
+  uint32_t need;
+  if (!t->offset)
+    return !t->size && !t->end_addr;
+  if (t->base_addr > t->start_addr || t->start_addr > t->end_addr)
+    return 0;
+  need = t->end_addr - t->base_addr;
+  if (idx >= mbit_input_registers) need *= 2u;
+  return t->offset % MB_IMAGE_ALIGN == 0 && t->size >= need &&
+      (uint64_t)t->offset + t->size <= total_size;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//O(devices), tables themselves aren't touched
+static int
+image_valid(const mb_image_t* img) {
+  const mb_image_header_t* h = img->hdr;
+  const mb_image_device_t* d;
+  uint32_t i, t;
+
+  if (h->magic != MB_IMAGE_MAGIC || h->version != MB_IMAGE_VERSION ||
+      h->header_size != sizeof(mb_image_header_t) ||
+      h->total_size > img->map_len ||
+      h->devices_count > MB_MAX_ADDRESS ||
+      h->header_size + (uint64_t)h->devices_count * sizeof(mb_image_device_t) > h->total_size)
+    return 0;
+
+  for (i = 0; i < 256; ++i)
+    if (h->device_idx[i] != MB_IMAGE_NO_DEVICE && h->device_idx[i] >= h->devices_count)
+      return 0;
+
+  d = (const mb_image_device_t*)((const uint8_t*)h + h->header_size);
+  for (i = 0; i < h->devices_count; ++i, ++d) {
+    if (h->device_idx[d->address] != i ||
+        d->ro_offset % sizeof(uint32_t) ||
+        d->ro_offset + (uint64_t)d->ro_count * sizeof(mb_image_range_t) > h->total_size)
+      return 0;
+    for (t = 0; t < mbit_count; ++t)
+      if (!table_valid(&d->tables[t], (uint8_t)t, h->total_size))
+        return 0;
+  }
+  return 1;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_image_open(mb_image_t* img, const char* path) {
+  struct stat st;
+  void* p;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  if (fstat(fd, &st) || (uint64_t)st.st_size < sizeof(mb_image_header_t)) {
+    close(fd);
+    return -1;
+  }
+  //private writable mapping : device changes tables, file stays intact
+  p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return -1;
+
+  img->hdr = (mb_image_header_t*)p;
+  img->map_len = (uint64_t)st.st_size;
+  if (!image_valid(img)) {
+    mb_image_close(img);
+    return -1;
+  }
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_image_close(mb_image_t* img) {
+  if (!img->hdr) return;
+  munmap(img->hdr, img->map_len);
+  img->hdr = NULL;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//real_addr is indexed by address, table begins at base_addr
+static inline uint8_t*
+image_bits(mb_image_t* img, const mb_image_table_t* t) {
+  return t->offset ? (uint8_t*)img->hdr + t->offset - t->base_addr : NULL;
+}
+
+static inline uint16_t*
+image_registers(mb_image_t* img, const mb_image_table_t* t) {
+  return t->offset ? (uint16_t*)((uint8_t*)img->hdr + t->offset) - t->base_addr : NULL;
+}
+
+int
+mb_image_attach(mb_image_t* img, uint8_t address, mb_client_device_t* dev) {
+  const mb_image_device_t* d = mb_image_device(img, address);
+  const mb_image_table_t* t;
+  if (!d) return -1;
+
+  dev->address = address;
+  dev->ctx = img;
+  t = &d->tables[mbit_input_discrete];
+  dev->input_discrete_map.start_addr = t->start_addr;
+  dev->input_discrete_map.end_addr = t->end_addr;
+  dev->input_discrete_map.real_addr = image_bits(img, t);
+  dev->input_discrete_map.flags = t->flags;
+  dev->input_discrete_map.seqlock = NULL;
+  t = &d->tables[mbit_coils];
+  dev->coils_map.start_addr = t->start_addr;
+  dev->coils_map.end_addr = t->end_addr;
+  dev->coils_map.real_addr = image_bits(img, t);
+  dev->coils_map.flags = t->flags;
+  dev->coils_map.seqlock = NULL;
+  t = &d->tables[mbit_input_registers];
+  dev->input_registers_map.start_addr = t->start_addr;
+  dev->input_registers_map.end_addr = t->end_addr;
+  dev->input_registers_map.real_addr = image_registers(img, t);
+  dev->input_registers_map.flags = t->flags;
+  dev->input_registers_map.seqlock = NULL;
+  t = &d->tables[mbit_holding_registers];
+  dev->holding_registers_map.start_addr = t->start_addr;
+  dev->holding_registers_map.end_addr = t->end_addr;
+  dev->holding_registers_map.real_addr = image_registers(img, t);
+  dev->holding_registers_map.flags = t->flags;
+  dev->holding_registers_map.seqlock = NULL;
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//ranges are sorted and don't overlap, binary search for the first one
+//which ends at or after addr
+static int
+range_denied(const mb_image_range_t* r, uint32_t n, uint8_t table,
+             uint16_t addr, uint16_t qty) {
+  uint32_t lo = 0, hi = n, mid;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (r[mid].table < table || (r[mid].table == table && r[mid].last < addr))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < n && r[lo].table == table && r[lo].first < (uint32_t)addr + qty;
+}
+//////////////////////////////////////////////////////////////////////////
+
+uint16_t
+mb_image_check_write(const mb_image_t* img, uint8_t address,
+                     const mb_request_t* req) {
+  const mb_image_device_t* d = mb_image_device(img, address);
+  uint8_t table;
+
+  if (!d || !d->ro_count || !req->wr_quantity) return mbec_OK;
+  switch (req->table) {
+    case mbt_coils:
+      table = mbit_coils;
+      break;
+    case mbt_holding_registers:
+      table = mbit_holding_registers;
+      break;
+    default:
+      return mbec_OK;
+  }
+  return range_denied(image_ranges(img, d), d->ro_count, table,
+                      req->wr_address, req->wr_quantity) ?
+      mbec_illegal_data_address : mbec_OK;
+}
+//////////////////////////////////////////////////////////////////////////
+
+uint16_t
+mb_image_check_bus_write(mb_client_device_t* dev, const mb_request_t* req) {
+  if (!dev->ctx) return mbec_OK;
+  return mb_image_check_write((const mb_image_t*)dev->ctx, dev->address, req);
+}
+//////////////////////////////////////////////////////////////////////////
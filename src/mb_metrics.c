@@ -0,0 +1,248 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "commons.h"
+#include "heap_memory.h"
+#include "mb_metrics.h"
+
+typedef struct mt_out {
+  char* p;
+  char* end;
+  uint8_t overflow;
+} mt_out_t;
+
+static void
+put(mt_out_t* o, const char* s, uint32_t n) {
+  if (o->overflow || (uint32_t)(o->end - o->p) < n) {
+    o->overflow = 1;
+    return;
+  }
+  memcpy(o->p, s, n);
+  o->p += n;
+}
+//////////////////////////////////////////////////////////////////////////
+
+#define put_lit(o, s) put((o), (s), sizeof(s) - 1)
+
+static inline void
+put_str(mt_out_t* o, const char* s) {
+  put(o, s, (uint32_t)strlen(s));
+}
+
+static void
+put_u32(mt_out_t* o, uint32_t v) {
+  char b[11];
+  char* d = uint32_to_str(b, v, sizeof(b));
+  put(o, d, (uint32_t)(&b[sizeof(b) - 1] - d));
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+put_type(mt_out_t* o, const char* name, const char* type) {
+  put_lit(o, "# TYPE ");
+  put_str(o, name);
+  put(o, " ", 1);
+  put_str(o, type);
+  put(o, "\n", 1);
+}
+//////////////////////////////////////////////////////////////////////////
+
+//name value\n
+static void
+put_sample(mt_out_t* o, const char* name, uint32_t val) {
+  put_str(o, name);
+  put(o, " ", 1);
+  put_u32(o, val);
+  put(o, "\n", 1);
+}
+//////////////////////////////////////////////////////////////////////////
+
+typedef struct mt_counter {
+  const char* name;
+  uint8_t offset;   //in mb_counters_t
+  uint8_t per_slave;
+} mt_counter_t;
+
+static const mt_counter_t counters[] = {
+  {"modbus_bus_messages_total", offsetof(mb_counters_t, bus_msg), 0},
+  {"modbus_bus_comm_errors_total", offsetof(mb_counters_t, bus_com_err), 0},
+  {"modbus_bus_char_overruns_total", offsetof(mb_counters_t, bus_char_overrrun), 0},
+  {"modbus_busy_total", offsetof(mb_counters_t, slave_busy), 0},
+  {"modbus_slave_messages_total", offsetof(mb_counters_t, slave_msg), 1},
+  {"modbus_slave_exceptions_total", offsetof(mb_counters_t, exc_err), 1},
+  {"modbus_slave_no_responses_total", offsetof(mb_counters_t, slave_no_resp), 1},
+  {"modbus_slave_naks_total", offsetof(mb_counters_t, slave_NAK), 1},
+};
+
+static inline uint32_t
+counter_value(const mb_counters_t* c, uint8_t offset) {
+  return *(const uint32_t*)((const uint8_t*)c + offset);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+render_counters(mt_out_t* o) {
+  mb_counters_t c[MB_MAX_SLAVES];
+  uint8_t addr[MB_MAX_SLAVES];
+  uint16_t n = 0, a, i, k;
+  char b[6];
+  char* d;
+
+  for (a = 1; a <= MB_MAX_ADDRESS && n < MB_MAX_SLAVES; ++a) {
+    if (mb_get_counters((uint8_t)a, &c[n]) != mbec_OK) continue;
+    addr[n++] = (uint8_t)a;
+  }
+  if (!n) return;
+
+  for (k = 0; k < sizeof(counters) / sizeof(counters[0]); ++k) {
+    put_type(o, counters[k].name, "counter");
+    if (!counters[k].per_slave) {
+      put_sample(o, counters[k].name, counter_value(&c[0], counters[k].offset));
+      continue;
+    }
+    for (i = 0; i < n; ++i) {
+      d = uint16_to_str(b, addr[i], sizeof(b));
+      put_str(o, counters[k].name);
+      put_lit(o, "{slave=\"");
+      put(o, d, (uint32_t)(&b[sizeof(b) - 1] - d));
+      put_lit(o, "\"} ");
+      put_u32(o, counter_value(&c[i], counters[k].offset));
+      put(o, "\n", 1);
+    }
+  }
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+render_heap(mt_out_t* o) {
+  hm_stat_t st;
+  hm_stat(&st);
+  put_type(o, "modbus_heap_size_bytes", "gauge");
+  put_sample(o, "modbus_heap_size_bytes", (uint32_t)st.size);
+  put_type(o, "modbus_heap_used_bytes", "gauge");
+  put_sample(o, "modbus_heap_used_bytes", (uint32_t)st.used);
+  put_type(o, "modbus_heap_free_bytes", "gauge");
+  put_sample(o, "modbus_heap_free_bytes", (uint32_t)st.free);
+  put_type(o, "modbus_heap_largest_free_bytes", "gauge");
+  put_sample(o, "modbus_heap_largest_free_bytes", (uint32_t)st.largest_free);
+  put_type(o, "modbus_heap_blocks", "gauge");
+  put_sample(o, "modbus_heap_blocks{state=\"used\"}", st.blocks_used);
+  put_sample(o, "modbus_heap_blocks{state=\"free\"}", st.blocks_free);
+  put_type(o, "modbus_heap_alloc_failures_total", "counter");
+  put_sample(o, "modbus_heap_alloc_failures_total", st.alloc_failures);
+  put_type(o, "modbus_heap_pool_used_blocks", "gauge");
+  put_sample(o, "modbus_heap_pool_used_blocks{pool=\"small\"}", hm_slab_used(0));
+  put_sample(o, "modbus_heap_pool_used_blocks{pool=\"adu\"}", hm_slab_used(1));
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+render_registers(mt_out_t* o, const mb_metrics_register_t* regs, uint16_t regs_count) {
+  uint16_t i;
+  if (!regs_count) return;
+  put_type(o, "modbus_register", "gauge");
+  for (i = 0; i < regs_count; ++i) {
+    put_lit(o, "modbus_register{slave=\"");
+    put_u32(o, regs[i].address);
+    put_lit(o, "\",name=\"");
+    put_str(o, regs[i].name);
+    put_lit(o, "\",addr=\"");
+    put_u32(o, regs[i].reg);
+    put_lit(o, "\"} ");
+    put_u32(o, mb_register_get(regs[i].map, regs[i].reg));
+    put(o, "\n", 1);
+  }
+}
+//////////////////////////////////////////////////////////////////////////
+
+uint32_t
+mb_metrics_render(char* buff, uint32_t buff_len,
+                  const mb_metrics_register_t* regs, uint16_t regs_count) {
+  mt_out_t o = {buff, buff + buff_len, 0};
+  render_counters(&o);
+  render_heap(&o);
+  render_registers(&o, regs, regs_count);
+  return o.overflow ? 0 : (uint32_t)(o.p - buff);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+write_all(int fd, const char* text, uint32_t len) {
+  ssize_t n;
+  while (len) {
+    n = write(fd, text, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    text += n;
+    len -= (uint32_t)n;
+  }
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_metrics_write_file(const char* path, const char* text, uint32_t len) {
+  char tmp[256];
+  size_t pl = strlen(path);
+  int fd, rc;
+  if (pl + sizeof(".tmp") > sizeof(tmp))
+    return -1;
+  memcpy(tmp, path, pl);
+  memcpy(tmp + pl, ".tmp", sizeof(".tmp"));
+
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    return -1;
+  rc = write_all(fd, text, len);
+  if (close(fd)) rc = -1;
+  if (rc || rename(tmp, path)) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_metrics_listen(const char* path) {
+  struct sockaddr_un sa;
+  int fd;
+  if (strlen(path) >= sizeof(sa.sun_path))
+    return -1;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  memcpy(sa.sun_path, path, strlen(path));
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return -1;
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) ||
+      listen(fd, 8) ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_metrics_serve(int fd, const char* text, uint32_t len) {
+  int served = 0, c;
+  while ((c = accept(fd, NULL, NULL)) >= 0) {
+    //scraper is local and reads at once. don't let slow one block us
+    fcntl(c, F_SETFL, fcntl(c, F_GETFL) | O_NONBLOCK);
+    if (!write_all(c, text, len)) ++served;
+    close(c);
+  }
+  return served;
+}
+//////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,149 @@
+#include "commons.h"
+#include "mb_monitor.h"
+#include "modbus_common.h"
+
+typedef struct mb_pending_request {
+  uint64_t ts_ns;
+  uint16_t len;
+  uint16_t crc;       //with len tells retry of request from late response
+  uint8_t addr;
+  uint8_t fc;
+  uint8_t active;
+} mb_pending_request_t;
+
+static mb_monitor_stat_t m_slave_stat[256];
+static mb_monitor_stat_t m_fc_stat[MB_MONITOR_FC_COUNT];
+static mb_monitor_bus_stat_t m_bus_stat;
+static mb_pending_request_t m_pending;
+static mb_pending_request_t m_expired; //the last timed out request
+static uint32_t m_timeout_ns;
+
+static void
+stat_clear(mb_monitor_stat_t* st, uint16_t n) {
+  for (; n--; ++st) {
+    st->requests = st->responses = st->exceptions = st->timeouts = 0;
+    st->latency_min = 0xffffffffu;
+    st->latency_max = 0;
+    st->latency_sum = 0;
+  }
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_monitor_init(uint32_t timeout_ns) {
+  stat_clear(m_slave_stat, 256);
+  stat_clear(m_fc_stat, MB_MONITOR_FC_COUNT);
+  m_bus_stat.frames = m_bus_stat.crc_errors = 0;
+  m_bus_stat.broadcasts = m_bus_stat.unexpected = 0;
+  m_bus_stat.late = 0;
+  m_pending.active = 0;
+  m_expired.active = 0;
+  m_timeout_ns = timeout_ns;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static inline void
+stat_response(mb_monitor_stat_t* st, uint32_t latency, uint8_t is_exception) {
+  ++st->responses;
+  st->exceptions += is_exception;
+  st->latency_sum += latency;
+  if (latency < st->latency_min) st->latency_min = latency;
+  if (latency > st->latency_max) st->latency_max = latency;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static inline void
+pending_timeout() {
+  ++m_slave_stat[m_pending.addr].timeouts;
+  ++m_fc_stat[m_pending.fc & 0x7f].timeouts;
+  m_expired = m_pending;
+  m_pending.active = 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_monitor_tick(uint64_t now_ns) {
+  if (m_pending.active && now_ns - m_pending.ts_ns > m_timeout_ns)
+    pending_timeout();
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_monitor_frame(const uint8_t* data, uint16_t len, uint64_t ts_ns) {
+  uint8_t addr, fc;
+  uint64_t latency;
+
+  ++m_bus_stat.frames;
+  if (len < 4 ||
+      crc16((uint8_t*)data, len - 2) != U16_LSBFromStream((uint8_t*)data + len - 2)) {
+    ++m_bus_stat.crc_errors;
+    return;
+  }
+
+  addr = data[0];
+  fc = data[1];
+  mb_monitor_tick(ts_ns);
+
+  //response is from the same address with the same function code,
+  //probably with exception bit.
+  if (m_pending.active && addr == m_pending.addr && (fc & 0x7f) == m_pending.fc) {
+    latency = ts_ns - m_pending.ts_ns;
+    if (latency > 0xffffffffu) latency = 0xffffffffu;
+    stat_response(&m_slave_stat[addr], (uint32_t)latency, fc >> 7);
+    stat_response(&m_fc_stat[fc & 0x7f], (uint32_t)latency, fc >> 7);
+    m_pending.active = 0;
+    return;
+  }
+
+  //response after timeout, the same frame is retry of request. echo
+  //responses (05, 06) look like retry and are counted as requests
+  if (m_expired.active && addr == m_expired.addr && (fc & 0x7f) == m_expired.fc) {
+    m_expired.active = 0;
+    if (len != m_expired.len || U16_LSBFromStream((uint8_t*)data + len - 2) != m_expired.crc) {
+      ++m_bus_stat.late;
+      return;
+    }
+  }
+  m_expired.active = 0;
+
+  if (m_pending.active)
+    pending_timeout(); //new request while waiting, previous is lost
+
+  if (fc & 0x80) { //exception without request
+    ++m_bus_stat.unexpected;
+    return;
+  }
+
+  ++m_slave_stat[addr].requests;
+  ++m_fc_stat[fc].requests;
+  if (addr == 0) { //broadcast is never answered
+    ++m_bus_stat.broadcasts;
+    return;
+  }
+
+  m_pending.addr = addr;
+  m_pending.fc = fc;
+  m_pending.ts_ns = ts_ns;
+  m_pending.len = len;
+  m_pending.crc = U16_LSBFromStream((uint8_t*)data + len - 2);
+  m_pending.active = 1;
+}
+//////////////////////////////////////////////////////////////////////////
+
+const mb_monitor_stat_t*
+mb_monitor_slave_stat(uint8_t address) {
+  return &m_slave_stat[address];
+}
+//////////////////////////////////////////////////////////////////////////
+
+const mb_monitor_stat_t*
+mb_monitor_fc_stat(uint8_t fc) {
+  return &m_fc_stat[fc & 0x7f];
+}
+//////////////////////////////////////////////////////////////////////////
+
+const mb_monitor_bus_stat_t*
+mb_monitor_bus_stat() {
+  return &m_bus_stat;
+}
+//////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,152 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mb_persist.h"
+
+#define PERSIST_MAGIC 0x5350424du /*"MBPS"*/
+#define PERSIST_VERSION 2
+#define PERSIST_PAGE 4096u
+#define page_align(x) (((x) + (PERSIST_PAGE - 1)) & ~(uint64_t)(PERSIST_PAGE - 1))
+//coils follow holding registers from 8 bytes boundary, mbbf_atomic needs it
+#define coils_offset(holding_count) (((uint64_t)(holding_count) * sizeof(uint16_t) + 7) & ~(uint64_t)7)
+
+//file : header page | working | snapshot 0 | snapshot 1
+typedef struct mb_persist_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t stable;        //snapshot with the last complete sync
+  uint16_t holding_count;
+  uint16_t coils_bytes;
+  uint32_t seq;           //incremented on every sync
+} mb_persist_header_t;
+
+static inline mb_persist_header_t*
+persist_header(mb_persist_t* p) {
+  return (mb_persist_header_t*)p->map;
+}
+
+static inline uint8_t*
+persist_region(mb_persist_t* p, uint8_t idx) { //0 - working, 1, 2 - snapshots
+  return p->map + PERSIST_PAGE + p->region_len * idx;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_persist_open(mb_persist_t* p, const char* path,
+                uint16_t holding_count, uint16_t coils_bytes,
+                uint8_t* restored) {
+  mb_persist_header_t* hdr;
+  struct stat st;
+  void* map;
+
+  p->holding_count = holding_count;
+  p->coils_bytes = coils_bytes;
+  p->region_len = page_align(coils_offset(holding_count) + coils_bytes);
+  p->map_len = PERSIST_PAGE + p->region_len * 3;
+  p->dirty = p->dirty_age_ms = 0;
+  *restored = 0;
+
+  if ((p->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+    return -1;
+  if (fstat(p->fd, &st) ||
+      ((uint64_t)st.st_size != p->map_len && ftruncate(p->fd, (off_t)p->map_len))) {
+    close(p->fd);
+    return -1;
+  }
+
+  map = mmap(NULL, p->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+  if (map == MAP_FAILED) {
+    close(p->fd);
+    return -1;
+  }
+
+  p->map = (uint8_t*)map;
+  p->holding = (uint16_t*)persist_region(p, 0);
+  p->coils = persist_region(p, 0) + coils_offset(holding_count);
+  hdr = persist_header(p);
+
+  if (hdr->magic == PERSIST_MAGIC && hdr->version == PERSIST_VERSION &&
+      hdr->holding_count == holding_count && hdr->coils_bytes == coils_bytes &&
+      hdr->stable < 2) {
+    memcpy(persist_region(p, 0), persist_region(p, 1 + hdr->stable), p->region_len);
+    *restored = 1;
+    return 0;
+  }
+
+  //new file or another layout
+  memset(p->map, 0, p->map_len);
+  hdr->magic = PERSIST_MAGIC;
+  hdr->version = PERSIST_VERSION;
+  hdr->stable = 0;
+  hdr->holding_count = holding_count;
+  hdr->coils_bytes = coils_bytes;
+  hdr->seq = 0;
+  if (msync(p->map, p->map_len, MS_SYNC)) {
+    mb_persist_close(p);
+    return -1;
+  }
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_persist_attach(mb_persist_t* p, mb_client_device_t* dev) {
+  if (dev->holding_registers_map.end_addr > p->holding_count ||
+      dev->coils_map.end_addr > p->coils_bytes)
+    return -1;
+  dev->holding_registers_map.real_addr = p->holding;
+  dev->coils_map.real_addr = p->coils;
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_persist_sync(mb_persist_t* p) {
+  mb_persist_header_t* hdr = persist_header(p);
+  uint16_t next = hdr->stable ^ 1;
+  uint8_t* snapshot = persist_region(p, 1 + next);
+
+  memcpy(snapshot, persist_region(p, 0), p->region_len);
+  if (msync(snapshot, p->region_len, MS_SYNC))
+    return -1;
+
+  hdr->stable = next;
+  ++hdr->seq;
+  if (msync(p->map, PERSIST_PAGE, MS_SYNC))
+    return -1;
+
+  p->dirty = p->dirty_age_ms = 0;
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_persist_note_write(mb_persist_t* p) {
+  if (p->dirty != 0xffff) ++p->dirty;
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_persist_poll(mb_persist_t* p, uint16_t elapsed_ms) {
+  if (!p->dirty) return;
+  p->dirty_age_ms = (uint32_t)p->dirty_age_ms + elapsed_ms > 0xffff ?
+        0xffff : p->dirty_age_ms + elapsed_ms;
+  if ((p->sync_writes && p->dirty >= p->sync_writes) ||
+      p->dirty_age_ms >= p->sync_delay_ms)
+    mb_persist_sync(p);
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_persist_close(mb_persist_t* p) {
+  if (!p->map) return;
+  if (p->dirty) mb_persist_sync(p);
+  munmap(p->map, p->map_len);
+  close(p->fd);
+  p->map = NULL;
+}
+//////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,42 @@
+#include "mb_profile.h"
+
+#ifdef MB_PROFILE
+
+static mb_histogram_t m_histograms[MB_PROFILE_MAX_FC][mbps_count] = {{{0}}};
+
+static inline uint8_t
+fc_slot(uint8_t fc) {
+  fc &= 0x7f;
+  return fc < MB_PROFILE_MAX_FC ? fc : 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_profile_record(uint8_t fc, mb_profile_stage_t stage, uint64_t cycles) {
+  mb_histogram_t* h = &m_histograms[fc_slot(fc)][stage];
+  uint8_t b = cycles ? 64 - __builtin_clzll(cycles) : 0;
+  if (b >= MB_PROFILE_BUCKETS) b = MB_PROFILE_BUCKETS - 1;
+  ++h->buckets[b];
+  ++h->count;
+  h->sum += cycles;
+  if (cycles > h->max)
+    h->max = cycles > 0xffffffffu ? 0xffffffffu : (uint32_t)cycles;
+}
+//////////////////////////////////////////////////////////////////////////
+
+const mb_histogram_t*
+mb_profile_histogram(uint8_t fc, mb_profile_stage_t stage) {
+  if (stage >= mbps_count) return 0;
+  return &m_histograms[fc_slot(fc)][stage];
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_profile_reset() {
+  uint8_t *p = (uint8_t*)m_histograms;
+  uint32_t n = sizeof(m_histograms);
+  while (n--) *p++ = 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+#endif
@@ -0,0 +1,201 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mb_seqlock.h"
+#include "mb_shm.h"
+
+#define SHM_ALIGN 64u
+#define shm_align(x) (((x) + (SHM_ALIGN - 1)) & ~(uint32_t)(SHM_ALIGN - 1))
+
+static int
+shm_map(mb_shm_t* shm, int fd, uint32_t map_len) {
+  void* p = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) return -1;
+  shm->fd = fd;
+  shm->map_len = map_len;
+  shm->hdr = (mb_shm_header_t*)p;
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static uint32_t
+shm_table_init(mb_shm_table_t* t, uint32_t offset, uint16_t start_addr,
+               uint16_t end_addr, uint8_t flags, uint32_t size) {
+  t->seq = 0;
+  t->offset = offset;
+  t->size = size;
+  t->start_addr = start_addr;
+  t->end_addr = end_addr;
+  t->flags = flags;
+  memset(t->reserved, 0, sizeof(t->reserved));
+  return offset + shm_align(size);
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_shm_create(mb_shm_t* shm, const char* name, const mb_client_device_t* layout) {
+  mb_shm_header_t hdr;
+  uint32_t off;
+  int fd;
+
+  memset(&hdr, 0, sizeof(hdr));
+  off = shm_align(sizeof(mb_shm_header_t));
+  off = shm_table_init(&hdr.tables[mbst_input_discrete], off,
+                       layout->input_discrete_map.start_addr,
+                       layout->input_discrete_map.end_addr,
+                       layout->input_discrete_map.flags,
+                       layout->input_discrete_map.end_addr);
+  off = shm_table_init(&hdr.tables[mbst_coils], off,
+                       layout->coils_map.start_addr,
+                       layout->coils_map.end_addr,
+                       layout->coils_map.flags,
+                       layout->coils_map.end_addr);
+  off = shm_table_init(&hdr.tables[mbst_input_registers], off,
+                       layout->input_registers_map.start_addr,
+                       layout->input_registers_map.end_addr,
+                       layout->input_registers_map.flags,
+                       layout->input_registers_map.end_addr * 2u);
+  off = shm_table_init(&hdr.tables[mbst_holding_registers], off,
+                       layout->holding_registers_map.start_addr,
+                       layout->holding_registers_map.end_addr,
+                       layout->holding_registers_map.flags,
+                       layout->holding_registers_map.end_addr * 2u);
+  hdr.magic = MB_SHM_MAGIC;
+  hdr.version = MB_SHM_VERSION;
+  hdr.header_size = sizeof(mb_shm_header_t);
+  hdr.total_size = off;
+
+  if ((fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0660)) < 0)
+    return -1;
+  if (ftruncate(fd, (off_t)off) || shm_map(shm, fd, off)) {
+    close(fd);
+    return -1;
+  }
+
+  //tables are already zeroed by ftruncate. magic goes last, so process
+  //opening segment right now never sees half written header
+  memcpy((uint8_t*)shm->hdr + sizeof(hdr.magic), (uint8_t*)&hdr + sizeof(hdr.magic),
+         sizeof(hdr) - sizeof(hdr.magic));
+  __atomic_store_n(&shm->hdr->magic, MB_SHM_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//segment is writable by any local process, nothing in header is trusted
+static int
+shm_table_valid(const mb_shm_table_t* t, uint8_t idx, uint32_t total_size) {
+  uint32_t need = idx < mbst_input_registers ? t->end_addr : t->end_addr * 2u;
+  return t->offset % SHM_ALIGN == 0 &&
+      t->offset >= shm_align(sizeof(mb_shm_header_t)) &&
+      t->start_addr <= t->end_addr && t->size >= need &&
+      (uint64_t)t->offset + t->size <= total_size;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_shm_open(mb_shm_t* shm, const char* name) {
+  uint8_t i;
+  struct stat st;
+  int fd;
+
+  if ((fd = shm_open(name, O_RDWR, 0)) < 0)
+    return -1;
+  if (fstat(fd, &st) ||
+      (uint64_t)st.st_size < sizeof(mb_shm_header_t) ||
+      shm_map(shm, fd, (uint32_t)st.st_size)) {
+    close(fd);
+    return -1;
+  }
+
+  if (__atomic_load_n(&shm->hdr->magic, __ATOMIC_ACQUIRE) != MB_SHM_MAGIC ||
+      shm->hdr->version != MB_SHM_VERSION ||
+      shm->hdr->header_size != sizeof(mb_shm_header_t) ||
+      shm->hdr->total_size > shm->map_len) {
+    mb_shm_close(shm);
+    return -1;
+  }
+  for (i = 0; i < mbst_count; ++i) {
+    if (!shm_table_valid(&shm->hdr->tables[i], i, shm->hdr->total_size)) {
+      mb_shm_close(shm);
+      return -1;
+    }
+  }
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_shm_close(mb_shm_t* shm) {
+  if (!shm->hdr) return;
+  munmap(shm->hdr, shm->map_len);
+  close(shm->fd);
+  shm->hdr = NULL;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_shm_unlink(const char* name) {
+  return shm_unlink(name);
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_shm_attach(mb_shm_t* shm, mb_client_device_t* dev) {
+  mb_shm_table_t* t = shm->hdr->tables;
+  dev->input_discrete_map.start_addr = t[mbst_input_discrete].start_addr;
+  dev->input_discrete_map.end_addr = t[mbst_input_discrete].end_addr;
+  dev->input_discrete_map.real_addr = mb_shm_table(shm, mbst_input_discrete);
+  dev->input_discrete_map.flags = t[mbst_input_discrete].flags;
+  dev->input_discrete_map.seqlock = &t[mbst_input_discrete].seq;
+  dev->coils_map.start_addr = t[mbst_coils].start_addr;
+  dev->coils_map.end_addr = t[mbst_coils].end_addr;
+  dev->coils_map.real_addr = mb_shm_table(shm, mbst_coils);
+  dev->coils_map.flags = t[mbst_coils].flags;
+  dev->coils_map.seqlock = &t[mbst_coils].seq;
+  dev->input_registers_map.start_addr = t[mbst_input_registers].start_addr;
+  dev->input_registers_map.end_addr = t[mbst_input_registers].end_addr;
+  dev->input_registers_map.real_addr =
+      (uint16_t*)mb_shm_table(shm, mbst_input_registers);
+  dev->input_registers_map.flags = t[mbst_input_registers].flags;
+  dev->input_registers_map.seqlock = &t[mbst_input_registers].seq;
+  dev->holding_registers_map.start_addr = t[mbst_holding_registers].start_addr;
+  dev->holding_registers_map.end_addr = t[mbst_holding_registers].end_addr;
+  dev->holding_registers_map.real_addr =
+      (uint16_t*)mb_shm_table(shm, mbst_holding_registers);
+  dev->holding_registers_map.flags = t[mbst_holding_registers].flags;
+  dev->holding_registers_map.seqlock = &t[mbst_holding_registers].seq;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_shm_read(mb_shm_t* shm, mb_shm_table_idx_t idx, uint32_t offset,
+            void* dst, uint32_t len) {
+  mb_shm_table_t* t = &shm->hdr->tables[idx];
+  const uint8_t* src = mb_shm_table(shm, idx) + offset;
+  uint32_t s;
+
+  if ((uint64_t)offset + len > t->size) return -1;
+  do {
+    if (!mb_seq_read_begin(&t->seq, &s)) return -1;
+    memcpy(dst, src, len);
+  } while (mb_seq_read_retry(&t->seq, s));
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_shm_write(mb_shm_t* shm, mb_shm_table_idx_t idx, uint32_t offset,
+             const void* src, uint32_t len) {
+  mb_shm_table_t* t = &shm->hdr->tables[idx];
+
+  if ((uint64_t)offset + len > t->size || !mb_seq_write_lock(&t->seq))
+    return -1;
+  memcpy(mb_shm_table(shm, idx) + offset, src, len);
+  mb_seq_write_unlock(&t->seq);
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,174 @@
+#define _POSIX_C_SOURCE 199309L
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mb_trace.h"
+
+#define TRACE_ALIGN 16u
+#define trace_align(x) (((x) + (TRACE_ALIGN - 1)) & ~(uint64_t)(TRACE_ALIGN - 1))
+#define trace_rec_size(len) trace_align(sizeof(mb_trace_record_t) + (len))
+
+uint64_t
+mb_trace_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+trace_map(mb_trace_t* trace, int fd, uint64_t map_len, int prot) {
+  void* p = mmap(NULL, map_len, prot, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) return -1;
+  trace->fd = fd;
+  trace->map_len = map_len;
+  trace->hdr = (mb_trace_header_t*)p;
+  trace->ring = (uint8_t*)p + trace_align(sizeof(mb_trace_header_t));
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_trace_create(mb_trace_t* trace, const char* path, uint64_t capacity) {
+  uint64_t map_len;
+  int fd;
+
+  capacity = trace_align(capacity);
+  if (capacity < trace_rec_size(256) * 2) return -1;
+  map_len = trace_align(sizeof(mb_trace_header_t)) + capacity;
+
+  if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    return -1;
+  if (ftruncate(fd, (off_t)map_len) ||
+      trace_map(trace, fd, map_len, PROT_READ | PROT_WRITE)) {
+    close(fd);
+    return -1;
+  }
+
+  trace->hdr->magic = MB_TRACE_MAGIC;
+  trace->hdr->version = MB_TRACE_VERSION;
+  trace->hdr->reserved = 0;
+  trace->hdr->capacity = capacity;
+  trace->hdr->head = trace->hdr->tail = 0;
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_trace_open(mb_trace_t* trace, const char* path) {
+  struct stat st;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  if (fstat(fd, &st) ||
+      (uint64_t)st.st_size < trace_align(sizeof(mb_trace_header_t)) ||
+      trace_map(trace, fd, (uint64_t)st.st_size, PROT_READ)) {
+    close(fd);
+    return -1;
+  }
+
+  if (trace->hdr->magic != MB_TRACE_MAGIC ||
+      trace->hdr->version != MB_TRACE_VERSION ||
+      !trace->hdr->capacity || trace->hdr->capacity % TRACE_ALIGN ||
+      trace->hdr->capacity + trace_align(sizeof(mb_trace_header_t)) > trace->map_len ||
+      trace->hdr->tail % TRACE_ALIGN ||
+      trace->hdr->tail > trace->hdr->head ||
+      trace->hdr->head - trace->hdr->tail > trace->hdr->capacity) {
+    mb_trace_close(trace);
+    return -1;
+  }
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_trace_close(mb_trace_t* trace) {
+  if (!trace->hdr) return;
+  munmap(trace->hdr, trace->map_len);
+  close(trace->fd);
+  trace->hdr = NULL;
+  trace->ring = NULL;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static inline uint64_t
+trace_size_at(const mb_trace_t* trace, uint64_t off) {
+  uint64_t pos = off % trace->hdr->capacity;
+  const mb_trace_record_t* rec = (const mb_trace_record_t*)(trace->ring + pos);
+  return rec->dir == mbtd_wrap ? trace->hdr->capacity - pos : trace_rec_size(rec->len);
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_trace_write_ts(mb_trace_t* trace, uint64_t ts_ns, mb_trace_dir_t dir,
+                  const uint8_t* data, uint16_t len) {
+  mb_trace_header_t* hdr = trace->hdr;
+  uint64_t head = hdr->head;
+  uint64_t tail = hdr->tail;
+  uint64_t pos = head % hdr->capacity;
+  uint64_t rs = trace_rec_size(len);
+  uint64_t skip = pos + rs > hdr->capacity ? hdr->capacity - pos : 0;
+  mb_trace_record_t* rec;
+
+  if (rs > hdr->capacity / 2) return; //never happens with modbus frames
+
+  while (head + skip + rs - tail > hdr->capacity)
+    tail += trace_size_at(trace, tail);
+  hdr->tail = tail;
+
+  if (skip) {
+    rec = (mb_trace_record_t*)(trace->ring + pos);
+    rec->dir = mbtd_wrap;
+    rec->len = 0;
+    head += skip;
+  }
+
+  rec = (mb_trace_record_t*)(trace->ring + head % hdr->capacity);
+  rec->ts_ns = ts_ns;
+  rec->len = len;
+  rec->dir = (uint8_t)dir;
+  memcpy(rec + 1, data, len);
+  __atomic_store_n(&hdr->head, head + rs, __ATOMIC_RELEASE);
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_trace_write(mb_trace_t* trace, mb_trace_dir_t dir,
+               const uint8_t* data, uint16_t len) {
+  mb_trace_write_ts(trace, mb_trace_now_ns(), dir, data, len);
+}
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t
+mb_trace_begin(const mb_trace_t* trace) {
+  return trace->hdr->tail;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+mb_trace_next(const mb_trace_t* trace, uint64_t* cursor,
+              const mb_trace_record_t** rec, const uint8_t** data) {
+  uint64_t head = __atomic_load_n(&trace->hdr->head, __ATOMIC_ACQUIRE);
+  uint64_t pos;
+  const mb_trace_record_t* r;
+
+  while (*cursor < head) {
+    pos = *cursor % trace->hdr->capacity;
+    r = (const mb_trace_record_t*)(trace->ring + pos);
+    //corrupt record would make us read past ring, treat it as the end
+    if (r->dir != mbtd_wrap && pos + trace_rec_size(r->len) > trace->hdr->capacity)
+      return 0;
+    *cursor += trace_size_at(trace, *cursor);
+    if (r->dir == mbtd_wrap) continue;
+    *rec = r;
+    *data = (const uint8_t*)(r + 1);
+    return 1;
+  }
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
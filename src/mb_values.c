@@ -0,0 +1,167 @@
+#include <string.h>
+
+#include "mb_values.h"
+
+#define bswap16(x) ((uint16_t)(((x) << 8) | ((x) >> 8)))
+
+//registers of wire order map are MSB first in memory, on little endian
+//cpu their bytes are already swapped relative to register value.
+static inline uint8_t
+need_bswap(const mb_dev_registers_mapping_t* map, uint8_t order) {
+  uint8_t bs = (order & mbvo_byte_swap) ? 1 : 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (map->flags & mbrf_wire_order) bs ^= 1;
+#else
+  (void)map;
+#endif
+  return bs;
+}
+//////////////////////////////////////////////////////////////////////////
+
+/*dst and src are bytes of value arrays, so floats and integers share
+ loops. memcpy of 4/8 bytes is just move for compiler*/
+
+static void
+get_32(const uint16_t* src, uint8_t* dst, uint16_t count, uint8_t bs, uint8_t ws) {
+  uint16_t i;
+  uint32_t v;
+#define GET32(hi, lo)                                 \
+  for (i = 0; i < count; ++i, src += 2, dst += 4) {   \
+    v = ((uint32_t)(hi) << 16) | (lo);                \
+    memcpy(dst, &v, sizeof(v));                       \
+  }
+  if (!bs && !ws) GET32(src[0], src[1])
+  else if (!bs) GET32(src[1], src[0])
+  else if (!ws) GET32(bswap16(src[0]), bswap16(src[1]))
+  else GET32(bswap16(src[1]), bswap16(src[0]))
+#undef GET32
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+set_32(uint16_t* dst, const uint8_t* src, uint16_t count, uint8_t bs, uint8_t ws) {
+  uint16_t i, hi, lo;
+  uint32_t v;
+#define SET32(r0, r1)                                 \
+  for (i = 0; i < count; ++i, src += 4, dst += 2) {   \
+    memcpy(&v, src, sizeof(v));                       \
+    hi = (uint16_t)(v >> 16);                         \
+    lo = (uint16_t)v;                                 \
+    dst[0] = (r0);                                    \
+    dst[1] = (r1);                                    \
+  }
+  if (!bs && !ws) SET32(hi, lo)
+  else if (!bs) SET32(lo, hi)
+  else if (!ws) SET32(bswap16(hi), bswap16(lo))
+  else SET32(bswap16(lo), bswap16(hi))
+#undef SET32
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+get_64(const uint16_t* src, uint8_t* dst, uint16_t count, uint8_t bs, uint8_t ws) {
+  uint16_t i;
+  uint64_t v;
+#define GET64(a, b, c, d)                                     \
+  for (i = 0; i < count; ++i, src += 4, dst += 8) {           \
+    v = ((uint64_t)(a) << 48) | ((uint64_t)(b) << 32) |       \
+        ((uint64_t)(c) << 16) | (uint64_t)(d);                \
+    memcpy(dst, &v, sizeof(v));                               \
+  }
+  if (!bs && !ws) GET64(src[0], src[1], src[2], src[3])
+  else if (!bs) GET64(src[3], src[2], src[1], src[0])
+  else if (!ws) GET64(bswap16(src[0]), bswap16(src[1]), bswap16(src[2]), bswap16(src[3]))
+  else GET64(bswap16(src[3]), bswap16(src[2]), bswap16(src[1]), bswap16(src[0]))
+#undef GET64
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+set_64(uint16_t* dst, const uint8_t* src, uint16_t count, uint8_t bs, uint8_t ws) {
+  uint16_t i, a, b, c, d;
+  uint64_t v;
+#define SET64(r0, r1, r2, r3)                                 \
+  for (i = 0; i < count; ++i, src += 8, dst += 4) {           \
+    memcpy(&v, src, sizeof(v));                               \
+    a = (uint16_t)(v >> 48);                                  \
+    b = (uint16_t)(v >> 32);                                  \
+    c = (uint16_t)(v >> 16);                                  \
+    d = (uint16_t)v;                                          \
+    dst[0] = (r0);                                            \
+    dst[1] = (r1);                                            \
+    dst[2] = (r2);                                            \
+    dst[3] = (r3);                                            \
+  }
+  if (!bs && !ws) SET64(a, b, c, d)
+  else if (!bs) SET64(d, c, b, a)
+  else if (!ws) SET64(bswap16(a), bswap16(b), bswap16(c), bswap16(d))
+  else SET64(bswap16(d), bswap16(c), bswap16(b), bswap16(a))
+#undef SET64
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_get_u32s(const mb_dev_registers_mapping_t* map, uint16_t addr,
+            uint32_t* dst, uint16_t count, uint8_t order) {
+  get_32(map->real_addr + addr, (uint8_t*)dst, count,
+         need_bswap(map, order), order & mbvo_word_swap);
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_set_u32s(mb_dev_registers_mapping_t* map, uint16_t addr,
+            const uint32_t* src, uint16_t count, uint8_t order) {
+  set_32(map->real_addr + addr, (const uint8_t*)src, count,
+         need_bswap(map, order), order & mbvo_word_swap);
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_get_f32s(const mb_dev_registers_mapping_t* map, uint16_t addr,
+            float* dst, uint16_t count, uint8_t order) {
+  get_32(map->real_addr + addr, (uint8_t*)dst, count,
+         need_bswap(map, order), order & mbvo_word_swap);
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_set_f32s(mb_dev_registers_mapping_t* map, uint16_t addr,
+            const float* src, uint16_t count, uint8_t order) {
+  set_32(map->real_addr + addr, (const uint8_t*)src, count,
+         need_bswap(map, order), order & mbvo_word_swap);
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_get_u64s(const mb_dev_registers_mapping_t* map, uint16_t addr,
+            uint64_t* dst, uint16_t count, uint8_t order) {
+  get_64(map->real_addr + addr, (uint8_t*)dst, count,
+         need_bswap(map, order), order & mbvo_word_swap);
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_set_u64s(mb_dev_registers_mapping_t* map, uint16_t addr,
+            const uint64_t* src, uint16_t count, uint8_t order) {
+  set_64(map->real_addr + addr, (const uint8_t*)src, count,
+         need_bswap(map, order), order & mbvo_word_swap);
+}
+//////////////////////////////////////////////////////////////////////////
+
+#if __SIZEOF_DOUBLE__ == 8
+void
+mb_get_f64s(const mb_dev_registers_mapping_t* map, uint16_t addr,
+            double* dst, uint16_t count, uint8_t order) {
+  get_64(map->real_addr + addr, (uint8_t*)dst, count,
+         need_bswap(map, order), order & mbvo_word_swap);
+}
+//////////////////////////////////////////////////////////////////////////
+
+void
+mb_set_f64s(mb_dev_registers_mapping_t* map, uint16_t addr,
+            const double* src, uint16_t count, uint8_t order) {
+  set_64(map->real_addr + addr, (const uint8_t*)src, count,
+         need_bswap(map, order), order & mbvo_word_swap);
+}
+//////////////////////////////////////////////////////////////////////////
+#endif
@@ -0,0 +1,521 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mb_image.h"
+#include "mb_values.h"
+#include "modbus_rtu_client.h"
+
+/*
+ * Compiles text description of device maps into image for mb_image_open.
+ * One statement per line, # starts comment :
+ *
+ *   device <address>                           1..247, next lines describe it
+ *   map <table> <first> <last> [atomic|wire]   table answers first..last
+ *   init <table> <addr> <type>[:<order>] <value>...
+ *   readonly <table> <first> [<last>]          bus can't write these
+ *
+ * table is discrete, coils, input or holding. Bit tables are addressed by
+ * bytes, so their ranges are widened to whole bytes. atomic is for coils
+ * (mbbf_atomic), wire for register tables (mbrf_wire_order).
+ * init writes consecutive values from addr : type is bit for bit tables,
+ * u16 i16 u32 i32 f32 u64 i64 f64 for register tables, order is abcd
+ * (default), cdab, badc or dcba as in mb_values.h.
+ * Numbers may be decimal, hex (0x) or octal (0).
+ *
+ *   device 1
+ *   map holding 0 99
+ *   init holding 0 f32:cdab 3.5 -1e3
+ *   readonly holding 0 3
+ */
+
+typedef struct mk_table {
+  uint8_t defined;
+  uint16_t start_addr;
+  uint16_t end_addr;
+  uint16_t base_addr;     //data[0] is this byte or register
+  uint8_t flags;
+  uint8_t* data;
+  uint32_t size;
+} mk_table_t;
+
+typedef struct mk_device {
+  uint8_t defined;
+  mk_table_t tables[mbit_count];
+  mb_image_range_t* ro;
+  uint32_t ro_count;
+  uint32_t ro_cap;
+} mk_device_t;
+
+static mk_device_t m_devs[MB_MAX_ADDRESS + 1];
+static const char* m_file;
+static uint32_t m_line;
+
+static const char* const m_tables[mbit_count] = {"discrete", "coils", "input", "holding"};
+
+#define is_bit_table(t) ((t) < mbit_input_registers)
+#define mk_align(x) (((x) + (MB_IMAGE_ALIGN - 1)) & ~(uint32_t)(MB_IMAGE_ALIGN - 1))
+
+static int
+fail(const char* msg, const char* tok) {
+  fprintf(stderr, "%s:%u: %s%s%s\n", m_file, m_line, msg, tok ? " : " : "", tok ? tok : "");
+  return -1;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+parse_num(const char* tok, uint32_t max, uint32_t* v) {
+  char* end;
+  unsigned long n;
+  if (!tok) return fail("number expected", NULL);
+  errno = 0;
+  n = strtoul(tok, &end, 0);
+  if (errno || *end || end == tok || tok[0] == '-' || n > max)
+    return fail("bad number", tok);
+  *v = (uint32_t)n;
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+parse_table(const char* tok, uint8_t* t) {
+  if (!tok) return fail("table expected", NULL);
+  for (*t = 0; *t < mbit_count; ++*t)
+    if (!strcmp(tok, m_tables[*t])) return 0;
+  return fail("unknown table", tok);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+map_table(mk_device_t* d, char** tok) {
+  uint8_t t;
+  uint32_t first, last;
+  mk_table_t* tb;
+
+  if (parse_table(tok[0], &t)) return -1;
+  tb = &d->tables[t];
+  if (tb->defined) return fail("table is already mapped", tok[0]);
+  //end_addr of register map is 16 bit too
+  if (parse_num(tok[1], is_bit_table(t) ? 0xffff : 0xfffe, &first) ||
+      parse_num(tok[2], is_bit_table(t) ? 0xffff : 0xfffe, &last))
+    return -1;
+  if (last < first) return fail("last is less than first", tok[2]);
+
+  tb->flags = 0;
+  if (tok[3]) {
+    if (t == mbit_coils && !strcmp(tok[3], "atomic"))
+      tb->flags = mbbf_atomic;
+    else if (!is_bit_table(t) && !strcmp(tok[3], "wire"))
+      tb->flags = mbrf_wire_order;
+    else
+      return fail("unknown flag", tok[3]);
+    if (tok[4]) return fail("unexpected", tok[4]);
+  }
+
+  if (is_bit_table(t)) {
+    tb->start_addr = (uint16_t)(first / 8);
+    tb->end_addr = (uint16_t)(last / 8 + 1);
+    tb->base_addr = tb->start_addr;
+    if (tb->flags & mbbf_atomic) //whole aligned words, see mb_coils.h
+      tb->base_addr &= (uint16_t)~7u;
+    tb->size = (uint32_t)tb->end_addr - tb->base_addr;
+    if (tb->flags & mbbf_atomic)
+      tb->size = (tb->size + 7) & ~7u;
+  } else {
+    tb->start_addr = (uint16_t)first;
+    tb->end_addr = (uint16_t)(last + 1);
+    tb->base_addr = tb->start_addr;
+    tb->size = ((uint32_t)tb->end_addr - tb->base_addr) * 2u;
+  }
+  if (!(tb->data = (uint8_t*)calloc(1, tb->size)))
+    return fail("out of memory", NULL);
+  tb->defined = 1;
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//width in registers, 0 - bit
+static int
+parse_type(const char* tok, uint8_t* width, uint8_t* sign, uint8_t* real, uint8_t* order) {
+  static const char* const orders[] = {"abcd", "cdab", "badc", "dcba"};
+  static const uint8_t order_vals[] = {mbvo_abcd, mbvo_cdab, mbvo_badc, mbvo_dcba};
+  const char* o;
+  size_t n;
+  uint8_t i;
+
+  if (!tok) return fail("type expected", NULL);
+  o = strchr(tok, ':');
+  n = o ? (size_t)(o - tok) : strlen(tok);
+  *order = mbvo_abcd;
+  if (o) {
+    for (i = 0; i < 4 && strcmp(o + 1, orders[i]); ++i)
+      ;
+    if (i == 4) return fail("unknown order", o + 1);
+    *order = order_vals[i];
+  }
+
+  *sign = *real = 0;
+  if (n == 3 && !strncmp(tok, "bit", 3)) {
+    *width = 0;
+    return o ? fail("bit has no order", tok) : 0;
+  }
+  if (n != 3 || (tok[0] != 'u' && tok[0] != 'i' && tok[0] != 'f'))
+    return fail("unknown type", tok);
+  *sign = tok[0] == 'i';
+  *real = tok[0] == 'f';
+  if (!strncmp(tok + 1, "16", 2) && !*real) *width = 1;
+  else if (!strncmp(tok + 1, "32", 2)) *width = 2;
+  else if (!strncmp(tok + 1, "64", 2)) *width = 4;
+  else return fail("unknown type", tok);
+  if (*width == 1 && o) return fail("16 bit value has no order", tok);
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+init_value(mb_dev_registers_mapping_t* map, uint16_t addr, const char* tok,
+           uint8_t width, uint8_t sign, uint8_t real, uint8_t order) {
+  char* end;
+  unsigned long long u = 0;
+  long long s = 0;
+  double f = 0;
+
+  errno = 0;
+  if (real) f = strtod(tok, &end);
+  else if (sign) s = strtoll(tok, &end, 0);
+  else u = strtoull(tok, &end, 0);
+  if (errno || *end || end == tok || (!real && !sign && tok[0] == '-'))
+    return fail("bad value", tok);
+
+  switch (width) {
+    case 1:
+      if (sign ? (s < INT16_MIN || s > INT16_MAX) : u > UINT16_MAX)
+        return fail("value doesn't fit", tok);
+      mb_register_set(map, addr, sign ? (uint16_t)(int16_t)s : (uint16_t)u);
+      break;
+    case 2:
+      if (real) mb_set_f32(map, addr, (float)f, order);
+      else if (sign ? (s < INT32_MIN || s > INT32_MAX) : u > UINT32_MAX)
+        return fail("value doesn't fit", tok);
+      else mb_set_u32(map, addr, sign ? (uint32_t)(int32_t)s : (uint32_t)u, order);
+      break;
+    default:
+      if (real) mb_set_f64(map, addr, f, order);
+      else mb_set_u64(map, addr, sign ? (uint64_t)s : (uint64_t)u, order);
+      break;
+  }
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+init_table(mk_device_t* d, char** tok) {
+  mb_dev_registers_mapping_t map;
+  uint8_t t, width, sign, real, order;
+  uint32_t addr, first, last, v;
+  mk_table_t* tb;
+
+  if (parse_table(tok[0], &t)) return -1;
+  tb = &d->tables[t];
+  if (!tb->defined) return fail("table isn't mapped", tok[0]);
+  if (parse_num(tok[1], 0xffff, &addr) ||
+      parse_type(tok[2], &width, &sign, &real, &order))
+    return -1;
+  if (is_bit_table(t) != !width) return fail("type doesn't fit table", tok[2]);
+  if (!tok[3]) return fail("value expected", NULL);
+
+  first = is_bit_table(t) ? tb->start_addr * 8u : tb->start_addr;
+  last = is_bit_table(t) ? tb->end_addr * 8u : tb->end_addr;
+  map.start_addr = tb->start_addr;
+  map.end_addr = tb->end_addr;
+  map.real_addr = (uint16_t*)tb->data - tb->base_addr;
+  map.flags = tb->flags;
+  map.seqlock = NULL;
+
+  for (tok += 3; *tok; ++tok, addr += width ? width : 1) {
+    if (addr < first || addr + (width ? width : 1) > last)
+      return fail("value is out of map", *tok);
+    if (width) {
+      if (init_value(&map, (uint16_t)addr, *tok, width, sign, real, order)) return -1;
+      continue;
+    }
+    if (parse_num(*tok, 1, &v)) return -1;
+    if (v) tb->data[addr / 8 - tb->base_addr] |= (uint8_t)(0x80 >> (addr % 8));
+    else tb->data[addr / 8 - tb->base_addr] &= (uint8_t)~(0x80 >> (addr % 8));
+  }
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+readonly_range(mk_device_t* d, char** tok) {
+  uint8_t t;
+  uint32_t first, last;
+  mb_image_range_t* r;
+
+  if (parse_table(tok[0], &t)) return -1;
+  if (t != mbit_coils && t != mbit_holding_registers)
+    return fail("bus can't write table anyway", tok[0]);
+  if (parse_num(tok[1], 0xffff, &first)) return -1;
+  last = first;
+  if (tok[2] && parse_num(tok[2], 0xffff, &last)) return -1;
+  if (last < first) return fail("last is less than first", tok[2]);
+
+  if (d->ro_count == d->ro_cap) {
+    d->ro_cap = d->ro_cap ? d->ro_cap * 2 : 16;
+    if (!(r = (mb_image_range_t*)realloc(d->ro, d->ro_cap * sizeof(*r))))
+      return fail("out of memory", NULL);
+    d->ro = r;
+  }
+  r = &d->ro[d->ro_count++];
+  memset(r, 0, sizeof(*r));
+  r->table = t;
+  r->first = (uint16_t)first;
+  r->last = (uint16_t)last;
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+range_cmp(const void* a, const void* b) {
+  const mb_image_range_t* x = (const mb_image_range_t*)a;
+  const mb_image_range_t* y = (const mb_image_range_t*)b;
+  if (x->table != y->table) return x->table < y->table ? -1 : 1;
+  return x->first < y->first ? -1 : x->first > y->first;
+}
+
+//sorted and merged, mb_image_check_write does binary search on them
+static void
+ranges_normalize(mk_device_t* d) {
+  uint32_t i, n = 0;
+  if (!d->ro_count) return;
+  qsort(d->ro, d->ro_count, sizeof(*d->ro), range_cmp);
+  for (i = 1; i < d->ro_count; ++i) {
+    if (d->ro[i].table == d->ro[n].table && d->ro[i].first <= d->ro[n].last + 1u) {
+      if (d->ro[i].last > d->ro[n].last) d->ro[n].last = d->ro[i].last;
+      continue;
+    }
+    d->ro[++n] = d->ro[i];
+  }
+  d->ro_count = n + 1;
+}
+//////////////////////////////////////////////////////////////////////////
+
+#define MAX_TOKENS 8192
+
+static int
+parse(FILE* f) {
+  static char* tok[MAX_TOKENS + 1];
+  mk_device_t* d = NULL;
+  char* line = NULL;
+  char *p, *save;
+  size_t cap = 0;
+  uint32_t n, addr;
+  int rc = 0;
+
+  for (m_line = 1; !rc && getline(&line, &cap, f) >= 0; ++m_line) {
+    if ((p = strchr(line, '#'))) *p = 0;
+    for (n = 0, p = strtok_r(line, " \t\r\n", &save); p && n < MAX_TOKENS;
+         p = strtok_r(NULL, " \t\r\n", &save))
+      tok[n++] = p;
+    tok[n] = NULL;
+    if (!n) continue;
+    if (p) {
+      rc = fail("line is too long, split it", NULL);
+    } else if (!strcmp(tok[0], "device")) {
+      if (!(rc = parse_num(tok[1], MB_MAX_ADDRESS, &addr))) {
+        if (!addr) rc = fail("broadcast address", tok[1]);
+        else if (m_devs[addr].defined) rc = fail("device is already described", tok[1]);
+        else (d = &m_devs[addr])->defined = 1;
+      }
+    } else if (!d) {
+      rc = fail("device expected", tok[0]);
+    } else if (!strcmp(tok[0], "map")) {
+      rc = map_table(d, tok + 1);
+    } else if (!strcmp(tok[0], "init")) {
+      rc = init_table(d, tok + 1);
+    } else if (!strcmp(tok[0], "readonly")) {
+      rc = readonly_range(d, tok + 1);
+    } else {
+      rc = fail("unknown statement", tok[0]);
+    }
+  }
+  free(line);
+  return rc;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//header | devices | read only ranges | tables
+static int
+write_image(const char* path) {
+  static mb_image_header_t hdr;
+  mb_image_device_t dd;
+  mk_device_t* d;
+  uint32_t a, t, ro_off, tbl_off, off;
+  uint8_t zero[MB_IMAGE_ALIGN] = {0};
+  char tmp[256];
+  FILE* f;
+  int ok;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memset(hdr.device_idx, MB_IMAGE_NO_DEVICE, sizeof(hdr.device_idx));
+  ro_off = sizeof(hdr);
+  for (a = 1; a <= MB_MAX_ADDRESS; ++a) {
+    if (!m_devs[a].defined) continue;
+    ranges_normalize(&m_devs[a]);
+    hdr.device_idx[a] = (uint8_t)hdr.devices_count++;
+    ro_off += sizeof(mb_image_device_t);
+  }
+  if (!hdr.devices_count) {
+    fprintf(stderr, "%s: no devices\n", m_file);
+    return -1;
+  }
+
+  tbl_off = ro_off;
+  for (a = 1; a <= MB_MAX_ADDRESS; ++a)
+    tbl_off += m_devs[a].ro_count * sizeof(mb_image_range_t);
+  tbl_off = mk_align(tbl_off);
+  off = tbl_off;
+  for (a = 1; a <= MB_MAX_ADDRESS; ++a)
+    for (t = 0; t < mbit_count; ++t)
+      if (m_devs[a].tables[t].defined)
+        off += mk_align(m_devs[a].tables[t].size);
+
+  hdr.magic = MB_IMAGE_MAGIC;
+  hdr.version = MB_IMAGE_VERSION;
+  hdr.header_size = sizeof(hdr);
+  hdr.total_size = off;
+
+  if (strlen(path) + sizeof(".tmp") > sizeof(tmp)) return -1;
+  strcpy(tmp, path);
+  strcat(tmp, ".tmp");
+  if (!(f = fopen(tmp, "wb"))) {
+    perror(tmp);
+    return -1;
+  }
+
+  ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+  off = tbl_off;
+  for (a = 1; ok && a <= MB_MAX_ADDRESS; ++a) {
+    d = &m_devs[a];
+    if (!d->defined) continue;
+    memset(&dd, 0, sizeof(dd));
+    dd.address = (uint8_t)a;
+    dd.ro_offset = ro_off;
+    dd.ro_count = d->ro_count;
+    ro_off += d->ro_count * sizeof(mb_image_range_t);
+    for (t = 0; t < mbit_count; ++t) {
+      if (!d->tables[t].defined) continue;
+      dd.tables[t].offset = off;
+      dd.tables[t].size = d->tables[t].size;
+      dd.tables[t].start_addr = d->tables[t].start_addr;
+      dd.tables[t].end_addr = d->tables[t].end_addr;
+      dd.tables[t].base_addr = d->tables[t].base_addr;
+      dd.tables[t].flags = d->tables[t].flags;
+      off += mk_align(d->tables[t].size);
+    }
+    ok = fwrite(&dd, sizeof(dd), 1, f) == 1;
+  }
+  for (a = 1; ok && a <= MB_MAX_ADDRESS; ++a)
+    if (m_devs[a].ro_count)
+      ok = fwrite(m_devs[a].ro, sizeof(mb_image_range_t), m_devs[a].ro_count, f) ==
+          m_devs[a].ro_count;
+  if (ok && ro_off != tbl_off)
+    ok = fwrite(zero, tbl_off - ro_off, 1, f) == 1;
+  for (a = 1; ok && a <= MB_MAX_ADDRESS; ++a)
+    for (t = 0; ok && t < mbit_count; ++t) {
+      d = &m_devs[a];
+      if (!d->tables[t].defined) continue;
+      ok = fwrite(d->tables[t].data, d->tables[t].size, 1, f) == 1;
+      if (ok && mk_align(d->tables[t].size) != d->tables[t].size)
+        ok = fwrite(zero, mk_align(d->tables[t].size) - d->tables[t].size, 1, f) == 1;
+    }
+
+  if (fclose(f)) ok = 0;
+  if (!ok || rename(tmp, path)) {
+    perror(path);
+    unlink(tmp);
+    return -1;
+  }
+  printf("%s : %u devices, %u bytes\n", path, hdr.devices_count, hdr.total_size);
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static int
+list_image(const char* path) {
+  mb_image_t img;
+  const mb_image_device_t* d;
+  const mb_image_range_t* r;
+  uint32_t a, t, i;
+
+  if (mb_image_open(&img, path)) {
+    fprintf(stderr, "%s isn't valid image\n", path);
+    return 2;
+  }
+  printf("%s : %u devices, %u bytes\n", path, img.hdr->devices_count, img.hdr->total_size);
+  for (a = 1; a <= MB_MAX_ADDRESS; ++a) {
+    if (!(d = mb_image_device(&img, (uint8_t)a))) continue;
+    printf("device %u\n", a);
+    for (t = 0; t < mbit_count; ++t) {
+      if (!d->tables[t].offset) continue;
+      printf("  %-8s start %u end %u base %u flags %u offset %u size %u\n", m_tables[t],
+             d->tables[t].start_addr, d->tables[t].end_addr, d->tables[t].base_addr,
+             d->tables[t].flags, d->tables[t].offset, d->tables[t].size);
+    }
+    r = (const mb_image_range_t*)((const uint8_t*)img.hdr + d->ro_offset);
+    for (i = 0; i < d->ro_count; ++i)
+      printf("  readonly %s %u %u\n", m_tables[r[i].table], r[i].first, r[i].last);
+  }
+  mb_image_close(&img);
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+usage(const char *name) {
+  fprintf(stderr, "usage : %s description image\n"
+                  "        %s -l image\n"
+                  "  -l  list devices of image\n", name, name);
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+main(int argc, char *argv[]) {
+  FILE* f;
+  int opt, list = 0, rc;
+
+  while ((opt = getopt(argc, argv, "l")) != -1) {
+    switch (opt) {
+      case 'l': list = 1; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+
+  if (list) {
+    if (optind >= argc) {
+      usage(argv[0]);
+      return 2;
+    }
+    return list_image(argv[optind]);
+  }
+  if (optind + 2 != argc) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  m_file = argv[optind];
+  if (!(f = fopen(m_file, "r"))) {
+    perror(m_file);
+    return 2;
+  }
+  rc = parse(f);
+  fclose(f);
+  if (rc || write_image(argv[optind + 1]))
+    return 1;
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////
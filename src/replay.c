@@ -0,0 +1,246 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "commons.h"
+#include "heap_memory.h"
+#include "mb_monitor.h"
+#include "mb_trace.h"
+#include "modbus_rtu_client.h"
+
+/*
+ * Feeds rx records of a bus trace through mb_handle_request and compares
+ * what device sends with tx records of the same trace.
+ * Device has full size zeroed tables, so captures should start from
+ * known state (or contain only reads of constant data) to match.
+ */
+
+#define REPLAY_BITS_BYTES 8192     //65536 bits
+#define REPLAY_REGISTERS  0xffff
+
+static uint8_t m_input_discrete[REPLAY_BITS_BYTES];
+static uint8_t m_coils[REPLAY_BITS_BYTES];
+static uint16_t m_input_registers[REPLAY_REGISTERS];
+static uint16_t m_holding_registers[REPLAY_REGISTERS];
+static mb_client_device_t m_dev;
+
+static uint8_t m_resp[mbaz_tcp];
+static uint16_t m_resp_len = 0;
+
+typedef struct replay_stat {
+  uint64_t requests;
+  uint64_t matched;
+  uint64_t mismatched;
+  uint64_t unexpected; //we answered, trace has no answer
+  uint64_t missing;    //trace has answer, we didn't answer
+} replay_stat_t;
+
+static replay_stat_t m_stat = {0};
+static int m_verbose = 1;
+
+static void
+send_capture(uint8_t *data, uint16_t len) {
+  memcpy(m_resp, data, len);
+  m_resp_len = len;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+print_frame(const char *prefix, const uint8_t *data, uint16_t len) {
+  printf("%s", prefix);
+  while (len--)
+    printf("%x ", *data++);
+  printf("\n");
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+replay_device_init(uint8_t address) {
+  m_dev.address = address;
+  m_dev.input_discrete_map.start_addr = 0;
+  m_dev.input_discrete_map.end_addr = REPLAY_BITS_BYTES;
+  m_dev.input_discrete_map.real_addr = m_input_discrete;
+  m_dev.coils_map.start_addr = 0;
+  m_dev.coils_map.end_addr = REPLAY_BITS_BYTES;
+  m_dev.coils_map.real_addr = m_coils;
+  m_dev.input_registers_map.start_addr = 0;
+  m_dev.input_registers_map.end_addr = REPLAY_REGISTERS;
+  m_dev.input_registers_map.real_addr = m_input_registers;
+  m_dev.holding_registers_map.start_addr = 0;
+  m_dev.holding_registers_map.end_addr = REPLAY_REGISTERS;
+  m_dev.holding_registers_map.real_addr = m_holding_registers;
+  m_dev.tp_send = send_capture;
+  hm_init();
+  mb_init(&m_dev);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+sleep_until(uint64_t ts_ns) {
+  struct timespec ts;
+  ts.tv_sec = ts_ns / 1000000000u;
+  ts.tv_nsec = ts_ns % 1000000000u;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+    ;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+replay_check_unanswered() {
+  if (!m_resp_len) return;
+  ++m_stat.unexpected;
+  if (m_verbose) print_frame("unexpected : ", m_resp, m_resp_len);
+  m_resp_len = 0;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+replay_pass(const mb_trace_t *trace, int timed) {
+  uint8_t work[mbaz_tcp];
+  const mb_trace_record_t *rec;
+  const uint8_t *data;
+  uint64_t cursor = mb_trace_begin(trace);
+  uint64_t first_ts = 0, start_ns = mb_trace_now_ns();
+  int first = 1;
+
+  while (mb_trace_next(trace, &cursor, &rec, &data)) {
+    if (rec->len > sizeof(work)) continue;
+    if (first) {
+      if (rec->dir != mbtd_rx) continue; //answer to request dropped by ring
+      first_ts = rec->ts_ns;
+      first = 0;
+    }
+
+    if (rec->dir == mbtd_rx) {
+      replay_check_unanswered();
+      if (timed) sleep_until(start_ns + (rec->ts_ns - first_ts));
+      memcpy(work, data, rec->len);
+      mb_handle_request(work, rec->len);
+      ++m_stat.requests;
+      continue;
+    }
+
+    if (!m_resp_len) {
+      ++m_stat.missing;
+      if (m_verbose) print_frame("missing : ", data, rec->len);
+      continue;
+    }
+
+    if (m_resp_len == rec->len && !memcmp(m_resp, data, rec->len)) {
+      ++m_stat.matched;
+    } else {
+      ++m_stat.mismatched;
+      if (m_verbose) {
+        print_frame("expected : ", data, rec->len);
+        print_frame("actual   : ", m_resp, m_resp_len);
+      }
+    }
+    m_resp_len = 0;
+  }
+  replay_check_unanswered();
+}
+//////////////////////////////////////////////////////////////////////////
+
+//all frames of trace go to passive monitor, device is not used
+static void
+monitor_pass(const mb_trace_t *trace) {
+  const mb_trace_record_t *rec;
+  const uint8_t *data;
+  uint64_t cursor = mb_trace_begin(trace);
+  while (mb_trace_next(trace, &cursor, &rec, &data))
+    mb_monitor_frame(data, rec->len, rec->ts_ns);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+monitor_print_stat(const char *kind, uint8_t key, const mb_monitor_stat_t *st) {
+  if (!st->requests && !st->responses) return;
+  printf("%s,%u,%u,%u,%u,%u,%u,%u,%.0f\n", kind, key, st->requests,
+         st->responses, st->exceptions, st->timeouts,
+         st->responses ? st->latency_min : 0, st->latency_max,
+         st->responses ? (double)st->latency_sum / st->responses : 0.0);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+monitor_report() {
+  const mb_monitor_bus_stat_t *bus = mb_monitor_bus_stat();
+  uint16_t i;
+  printf("frames=%u crc_errors=%u broadcasts=%u unexpected=%u late=%u\n",
+         bus->frames, bus->crc_errors, bus->broadcasts, bus->unexpected, bus->late);
+  printf("kind,key,requests,responses,exceptions,timeouts,"
+         "latency_min_ns,latency_max_ns,latency_avg_ns\n");
+  for (i = 0; i < 256; ++i)
+    monitor_print_stat("slave", (uint8_t)i, mb_monitor_slave_stat((uint8_t)i));
+  for (i = 0; i < MB_MONITOR_FC_COUNT; ++i)
+    monitor_print_stat("fc", (uint8_t)i, mb_monitor_fc_stat((uint8_t)i));
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+usage(const char *name) {
+  fprintf(stderr, "usage : %s [-a address] [-t] [-n loops] [-q] [-m] trace_file\n"
+                  "  -a  device address, default 1\n"
+                  "  -t  keep original timing, default is max speed\n"
+                  "  -n  replay trace n times\n"
+                  "  -q  don't print mismatched frames\n"
+                  "  -m  passive monitor statistics of trace, no replay\n", name);
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+main(int argc, char *argv[]) {
+  mb_trace_t trace;
+  uint8_t address = 1;
+  uint32_t loops = 1, i;
+  uint64_t t0, elapsed;
+  int timed = 0, monitor = 0, opt;
+
+  while ((opt = getopt(argc, argv, "a:tn:qm")) != -1) {
+    switch (opt) {
+      case 'a': address = (uint8_t)atoi(optarg); break;
+      case 't': timed = 1; break;
+      case 'n': loops = (uint32_t)atoi(optarg); break;
+      case 'q': m_verbose = 0; break;
+      case 'm': monitor = 1; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  if (mb_trace_open(&trace, argv[optind])) {
+    fprintf(stderr, "can't open trace %s\n", argv[optind]);
+    return 2;
+  }
+
+  if (monitor) {
+    mb_monitor_init(1000000000u);
+    monitor_pass(&trace);
+    mb_trace_close(&trace);
+    monitor_report();
+    return 0;
+  }
+
+  replay_device_init(address);
+  t0 = mb_trace_now_ns();
+  for (i = 0; i < loops; ++i)
+    replay_pass(&trace, timed);
+  elapsed = mb_trace_now_ns() - t0;
+  mb_trace_close(&trace);
+
+  printf("requests=%llu matched=%llu mismatched=%llu unexpected=%llu missing=%llu "
+         "elapsed_ns=%llu req_per_s=%.0f\n",
+         (unsigned long long)m_stat.requests, (unsigned long long)m_stat.matched,
+         (unsigned long long)m_stat.mismatched, (unsigned long long)m_stat.unexpected,
+         (unsigned long long)m_stat.missing, (unsigned long long)elapsed,
+         elapsed ? m_stat.requests * 1e9 / elapsed : 0.0);
+
+  return (m_stat.mismatched || m_stat.unexpected || m_stat.missing) ? 1 : 0;
+}
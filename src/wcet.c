@@ -0,0 +1,367 @@
+#define _POSIX_C_SOURCE 200809L
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "commons.h"
+#include "heap_memory.h"
+#include "mb_profile.h"
+#include "modbus_common.h"
+#include "modbus_rtu_client.h"
+
+/*
+ * Worst case execution time of mb_handle_request. Every supported
+ * function code is run with adversarial request : maximum quantities,
+ * bit offsets of 7, longest frames, exception and crc error paths. Heap
+ * is fragmented before every case and fixed size pools are exhausted, so
+ * every allocation walks the arena. Maximum cycles of every profile stage
+ * are reported per case, then worst total is checked against 3.5 character
+ * time of every baud rate.
+ *
+ * usage : modbus_wcet [-n iterations] [-c]
+ *   -c evicts caches before every request (cold cache worst case)
+ * On a host os preemption shows up as outliers, so process asks for
+ * SCHED_FIFO and locked memory when it is allowed to.
+ */
+
+#ifndef MB_PROFILE
+#error "wcet build needs MB_PROFILE, see Modbus.pro"
+#endif
+
+#define WCET_DEV_ADDR 0x01
+#define WCET_BITS_BYTES 256
+#define WCET_REGISTERS 256
+#define WCET_HEAP_RESERVE 800 //contiguous arena left for the largest case
+#define WCET_HOLE 20          //too small for anything but adu and payloads
+#define WCET_EVICT_BYTES (16u << 20)
+
+static uint8_t m_input_discrete[WCET_BITS_BYTES];
+static uint8_t m_coils[WCET_BITS_BYTES];
+static uint16_t m_input_registers[WCET_REGISTERS];
+static uint16_t m_holding_registers[WCET_REGISTERS];
+static mb_client_device_t m_dev;
+
+static uint8_t m_last_response[mbaz_tcp];
+static uint16_t m_last_response_len = 0;
+static uint8_t *m_evict = NULL;
+static volatile uint32_t m_sink = 0;
+
+typedef struct wcet_case {
+  const char *name;
+  uint8_t frame[mbaz_rs485];
+  uint16_t len;
+  uint8_t expect;       //response fc, 0 - no response (crc error)
+} wcet_case_t;
+
+static const char *stage_names[mbps_count] = {
+  "crc", "validate", "execute", "serialize", "send", "total"
+};
+//////////////////////////////////////////////////////////////////////////
+
+static void
+send_capture(uint8_t *data, uint16_t len) {
+  memcpy(m_last_response, data, len);
+  m_last_response_len = len;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//cycles of mb_cycles per microsecond
+static double
+calibrate() {
+  struct timespec t0, t1, d = {0, 50000000};
+  uint64_t c0, c1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  c0 = mb_cycles();
+  nanosleep(&d, NULL);
+  c1 = mb_cycles();
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (double)(c1 - c0) /
+      ((t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3);
+}
+//////////////////////////////////////////////////////////////////////////
+
+//returns 1 if nothing but interrupts can preempt us
+static int
+go_realtime() {
+  struct sched_param sp;
+  sp.sched_priority = sched_get_priority_max(SCHED_FIFO);
+  if (sched_setscheduler(0, SCHED_FIFO, &sp))
+    return 0;
+  mlockall(MCL_CURRENT | MCL_FUTURE);
+  return 1;
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+evict_caches() {
+  uint32_t i;
+  for (i = 0; i < WCET_EVICT_BYTES; i += 64)
+    m_evict[i] += 1;
+  m_sink += m_evict[m_sink % WCET_EVICT_BYTES];
+}
+//////////////////////////////////////////////////////////////////////////
+
+/*pools are filled and arena is left as holes separated by allocated
+ blocks, with WCET_HEAP_RESERVE at the end. blocks are never freed,
+ next case starts with hm_init*/
+static void
+fragment_heap() {
+  memory_t blocks[HM_HEAP_SIZE / (WCET_HOLE + 2)];
+  hm_stat_t st;
+  uint32_t i, n;
+
+  hm_init();
+  for (i = 0; i < HM_SLAB_ADU_COUNT; ++i)
+    hm_malloc(HM_SLAB_ADU_SIZE);
+  for (i = 0; i < HM_SLAB_SMALL_COUNT; ++i)
+    hm_malloc(HM_SLAB_SMALL_SIZE);
+
+  for (n = 0; n < sizeof(blocks) / sizeof(blocks[0]); ++n) {
+    hm_stat(&st);
+    if (st.largest_free < WCET_HEAP_RESERVE + 2 * WCET_HOLE)
+      break;
+    blocks[n] = hm_malloc(WCET_HOLE);
+  }
+  for (i = 0; i + 1 < n; i += 2)
+    hm_free(blocks[i]);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static void
+device_init() {
+  uint16_t i;
+  for (i = 0; i < WCET_BITS_BYTES; ++i) {
+    m_input_discrete[i] = (uint8_t)(i * 7);
+    m_coils[i] = (uint8_t)(i * 13);
+  }
+  for (i = 0; i < WCET_REGISTERS; ++i) {
+    m_input_registers[i] = i;
+    m_holding_registers[i] = i ^ 0x5a5a;
+  }
+
+  m_dev.address = WCET_DEV_ADDR;
+  m_dev.input_discrete_map.start_addr = 0;
+  m_dev.input_discrete_map.end_addr = WCET_BITS_BYTES;
+  m_dev.input_discrete_map.real_addr = m_input_discrete;
+  m_dev.coils_map.start_addr = 0;
+  m_dev.coils_map.end_addr = WCET_BITS_BYTES;
+  m_dev.coils_map.real_addr = m_coils;
+  m_dev.input_registers_map.start_addr = 0;
+  m_dev.input_registers_map.end_addr = WCET_REGISTERS;
+  m_dev.input_registers_map.real_addr = m_input_registers;
+  m_dev.holding_registers_map.start_addr = 0;
+  m_dev.holding_registers_map.end_addr = WCET_REGISTERS;
+  m_dev.holding_registers_map.real_addr = m_holding_registers;
+  m_dev.tp_send = send_capture;
+
+  hm_init();
+  mb_init(&m_dev);
+}
+//////////////////////////////////////////////////////////////////////////
+
+/*frame builders. all return whole frame length including crc*/
+
+static uint16_t
+frame_finish(uint8_t *frame, uint16_t len) {
+  U16_LSB2Stream(crc16(frame, len), frame + len);
+  return len + 2;
+}
+
+static uint16_t
+frame_addr_val(uint8_t *frame, uint8_t fc, uint16_t addr, uint16_t val) {
+  frame[0] = WCET_DEV_ADDR;
+  frame[1] = fc;
+  U16_MSB2Stream(addr, frame + 2);
+  U16_MSB2Stream(val, frame + 4);
+  return frame_finish(frame, 6);
+}
+
+//quantity/byte count header followed by payload of pattern bytes
+static uint16_t
+frame_write_multiple(uint8_t *frame, uint8_t fc, uint16_t addr,
+                     uint16_t quantity, uint8_t bc) {
+  uint16_t i;
+  frame[0] = WCET_DEV_ADDR;
+  frame[1] = fc;
+  U16_MSB2Stream(addr, frame + 2);
+  U16_MSB2Stream(quantity, frame + 4);
+  frame[6] = bc;
+  for (i = 0; i < bc; ++i)
+    frame[7 + i] = (uint8_t)(0xa5 ^ i);
+  return frame_finish(frame, 7 + bc);
+}
+
+static uint16_t
+frame_diag_echo(uint8_t *frame, uint8_t data_len) {
+  uint16_t i;
+  frame[0] = WCET_DEV_ADDR;
+  frame[1] = mbfc_diagnostic;
+  U16_MSB2Stream(0x0000, frame + 2); //return query data
+  for (i = 0; i < data_len; ++i)
+    frame[4 + i] = (uint8_t)i;
+  return frame_finish(frame, 4 + data_len);
+}
+
+static uint16_t
+frame_mask_write(uint8_t *frame) {
+  frame[0] = WCET_DEV_ADDR;
+  frame[1] = mbfc_mask_write_registers;
+  U16_MSB2Stream(WCET_REGISTERS - 1, frame + 2);
+  U16_MSB2Stream(0xf2f2, frame + 4);
+  U16_MSB2Stream(0x2525, frame + 6);
+  return frame_finish(frame, 8);
+}
+
+static uint16_t
+frame_short(uint8_t *frame, uint8_t fc, uint8_t mei) {
+  frame[0] = WCET_DEV_ADDR;
+  frame[1] = fc;
+  frame[2] = mei;
+  return frame_finish(frame, mei ? 3 : 2);
+}
+//////////////////////////////////////////////////////////////////////////
+
+static uint16_t
+build_cases(wcet_case_t *c) {
+  uint16_t n = 0;
+  uint8_t *f;
+
+#define CASE(nm, exp, build) \
+  do { c[n].name = (nm); c[n].expect = (exp); f = c[n].frame; c[n].len = (build); ++n; } while (0)
+
+  CASE("read coils 2000 @7", mbfc_read_coils,
+       frame_addr_val(f, mbfc_read_coils, 7, 2000));
+  CASE("read inputs 2000 @7", mbfc_read_discrete_input,
+       frame_addr_val(f, mbfc_read_discrete_input, 7, 2000));
+  CASE("read holding 125", mbfc_read_holding_registers,
+       frame_addr_val(f, mbfc_read_holding_registers, WCET_REGISTERS - 125, 125));
+  CASE("read input regs 125", mbfc_read_input_registers,
+       frame_addr_val(f, mbfc_read_input_registers, WCET_REGISTERS - 125, 125));
+  CASE("write coil last", mbfc_write_single_coil,
+       frame_addr_val(f, mbfc_write_single_coil, WCET_BITS_BYTES * 8 - 1, 0xff00));
+  CASE("write register last", mbfc_write_single_register,
+       frame_addr_val(f, mbfc_write_single_register, WCET_REGISTERS - 1, 0x1234));
+  CASE("write coils 1968 @7", mbfc_write_multiple_coils,
+       frame_write_multiple(f, mbfc_write_multiple_coils, 7, 1968, 246));
+  CASE("write registers 123", mbfc_write_multiple_registers,
+       frame_write_multiple(f, mbfc_write_multiple_registers, WCET_REGISTERS - 123, 123, 246));
+  CASE("mask write last", mbfc_mask_write_registers, frame_mask_write(f));
+  CASE("diag echo 250", mbfc_diagnostic, frame_diag_echo(f, 250));
+  CASE("report slave id", mbfc_report_device_id,
+       frame_short(f, mbfc_report_device_id, 0));
+  CASE("encapsulated 0e", mbfc_encapsulate_tp_info | 0x80,
+       frame_short(f, mbfc_encapsulate_tp_info, 0x0e));
+  CASE("exc address 125", mbfc_read_holding_registers | 0x80,
+       frame_addr_val(f, mbfc_read_holding_registers, WCET_REGISTERS - 124, 125));
+  CASE("exc function 17", mbfc_read_write_multiple_registers | 0x80,
+       frame_write_multiple(f, mbfc_read_write_multiple_registers, 0, 0, 0));
+  CASE("crc error 256", 0,
+       frame_write_multiple(f, mbfc_write_multiple_registers, 0, 123, 246));
+  c[n - 1].frame[c[n - 1].len - 1] ^= 0x5a;
+#undef CASE
+  return n;
+}
+//////////////////////////////////////////////////////////////////////////
+
+//returns 0 if responses were not as expected
+static int
+run_case(const wcet_case_t *c, uint32_t iters, uint8_t cold, uint32_t *worst) {
+  uint8_t work[mbaz_rs485];
+  const mb_histogram_t *h;
+  uint32_t i;
+  uint8_t s;
+
+  fragment_heap();
+  mb_profile_reset();
+  for (i = 0; i < iters; ++i) {
+    if (cold) evict_caches();
+    memcpy(work, c->frame, c->len);
+    m_last_response_len = 0;
+    mb_handle_request(work, c->len);
+    if (c->expect ? (m_last_response_len < 2 || m_last_response[1] != c->expect)
+                  : m_last_response_len != 0)
+      return 0;
+  }
+
+  for (s = 0; s < mbps_count; ++s) {
+    h = mb_profile_histogram(c->frame[1], (mb_profile_stage_t)s);
+    worst[s] = h->count ? h->max : 0;
+  }
+  return 1;
+}
+//////////////////////////////////////////////////////////////////////////
+
+int
+main(int argc, char **argv) {
+  static const uint32_t bauds[] = {9600, 19200, 38400, 57600, 115200};
+  static wcet_case_t cases[16];
+  uint32_t worst[mbps_count], total_worst = 0;
+  uint32_t iters = 2000;
+  const char *total_case = "";
+  uint8_t cold = 0, rt;
+  uint16_t n, i;
+  double cpu;
+  double t35, worst_us;
+  int opt;
+  uint8_t s;
+
+  while ((opt = getopt(argc, argv, "n:c")) != -1) {
+    switch (opt) {
+      case 'n': iters = (uint32_t)atoi(optarg); break;
+      case 'c': cold = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-n iterations] [-c]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (cold && !(m_evict = calloc(1, WCET_EVICT_BYTES))) {
+    perror("calloc");
+    return 1;
+  }
+
+  device_init();
+  n = build_cases(cases);
+  cpu = calibrate();
+  rt = (uint8_t)go_realtime();
+
+  printf("worst cycles per stage, %u iterations%s, %.1f cycles/us%s\n",
+         iters, cold ? ", cold cache" : "", cpu,
+         rt ? "" : ", no SCHED_FIFO (expect preemption outliers)");
+  printf("%-22s", "case");
+  for (s = 0; s < mbps_count; ++s)
+    printf("%10s", stage_names[s]);
+  printf("%10s\n", "total_us");
+
+  for (i = 0; i < n; ++i) {
+    if (!run_case(&cases[i], iters, cold, worst)) {
+      fprintf(stderr, "%s: unexpected response\n", cases[i].name);
+      return 1;
+    }
+    printf("%-22s", cases[i].name);
+    for (s = 0; s < mbps_count; ++s)
+      printf("%10u", worst[s]);
+    printf("%10.2f\n", worst[mbps_total] / cpu);
+    if (worst[mbps_total] > total_worst) {
+      total_worst = worst[mbps_total];
+      total_case = cases[i].name;
+    }
+  }
+
+  //request has to be handled before response may start
+  worst_us = total_worst / cpu;
+  printf("\nworst total %u cycles, %.2f us (%s)\n", total_worst, worst_us, total_case);
+  printf("%8s%12s%12s%8s\n", "baud", "t3.5_us", "margin_us", "fits");
+  for (i = 0; i < sizeof(bauds) / sizeof(bauds[0]); ++i) {
+    //11 bit characters, fixed 1750 us above 19200 as spec recommends
+    t35 = bauds[i] > 19200 ? 1750.0 : 3.5 * 11 * 1e6 / bauds[i];
+    printf("%8u%12.1f%12.1f%8s\n", bauds[i], t35, t35 - worst_us,
+           worst_us <= t35 ? "yes" : "NO");
+  }
+  free(m_evict);
+  return 0;
+}
+//////////////////////////////////////////////////////////////////////////